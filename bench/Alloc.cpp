@@ -0,0 +1,75 @@
+#include <QtGlobal>
+#include <atomic>
+
+#include "Bench.hpp"
+
+
+#ifdef __GLIBC__
+#include <malloc.h>
+
+extern "C"
+{
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* p);
+}
+
+static std::atomic<qint64> allocCount(0);
+static std::atomic<qint64> heapBytes(0);
+static std::atomic<qint64> peakHeapBytes(0);
+
+static void* Track(void* p)
+{
+	if (!p) return p;
+	++allocCount;
+	qint64 heap = heapBytes += malloc_usable_size(p);
+	qint64 peak = peakHeapBytes.load();
+	while (heap > peak && !peakHeapBytes.compare_exchange_weak(peak, heap)) {}
+	return p;
+}
+
+static void Untrack(void* p)
+{
+	if (p) heapBytes -= malloc_usable_size(p);
+}
+
+extern "C"
+{
+void* malloc(size_t size) { return Track(__libc_malloc(size)); }
+void* calloc(size_t n, size_t size) { return Track(__libc_calloc(n, size)); }
+void* memalign(size_t alignment, size_t size) { return Track(__libc_memalign(alignment, size)); }
+void* aligned_alloc(size_t alignment, size_t size) { return Track(__libc_memalign(alignment, size)); }
+void free(void* p)
+{
+	Untrack(p);
+	__libc_free(p);
+}
+void* realloc(void* p, size_t size)
+{
+	Untrack(p);
+	return Track(__libc_realloc(p, size));
+}
+int posix_memalign(void** out, size_t alignment, size_t size)
+{
+	void* p = Track(__libc_memalign(alignment, size));
+	if (!p) return 12; // ENOMEM
+	*out = p;
+	return 0;
+}
+}
+
+qint64 AllocCount() { return allocCount; }
+qint64 HeapBytes() { return heapBytes; }
+qint64 PeakHeapBytes() { return peakHeapBytes; }
+void ResetPeakHeap() { peakHeapBytes = heapBytes.load(); }
+
+#else
+
+qint64 AllocCount() { return 0; }
+qint64 HeapBytes() { return 0; }
+qint64 PeakHeapBytes() { return 0; }
+void ResetPeakHeap() {}
+
+#endif
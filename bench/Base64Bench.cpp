@@ -0,0 +1,49 @@
+#include "Base64.hpp"
+
+#include <cstdlib>
+
+#include "Bench.hpp"
+
+
+using namespace Nya;
+
+/**
+ * Attachment encoding as it was done before: a base64 line per 57-byte slice.
+ */
+static QByteArray EncodeSlices(const QByteArray& data)
+{
+	QByteArray encoded;
+	for (int pos = 0; pos < data.length(); pos += 57)
+	{
+		encoded += data.mid(pos, 57).toBase64() + "\r\n";
+	}
+	return encoded;
+}
+
+/**
+ * Wrapped encoding and decoding, Qt against each kernel.
+ */
+void BenchBase64(QTextStream& out)
+{
+	const char* kernelNames[] = { "scalar", "sse41", "avx2" };
+	Base64Kernel best = GetBase64Kernel();
+
+	for (int size : { 1024, 64 * 1024, 4 * 1024 * 1024 })
+	{
+		QByteArray data(size, Qt::Uninitialized);
+		for (int i = 0; i < size; ++i) data[i] = char(rand());
+		QByteArray wrapped = EncodeSlices(data);
+		QString suffix = "." + QString::number(size);
+
+		Run(out, "base64.encode.qt" + suffix, size, [&] { EncodeSlices(data); });
+		Run(out, "base64.decode.qt" + suffix, size, [&] { QByteArray::fromBase64(wrapped); });
+		for (int kernel = Base64Scalar; kernel <= best; ++kernel)
+		{
+			SetBase64Kernel(Base64Kernel(kernel));
+			QString name = kernelNames[kernel] + suffix;
+			Run(out, "base64.encode." + name, size, [&] { ToBase64(data, true); });
+			Run(out, "base64.decode." + name, size, [&] { FromBase64(wrapped); });
+		}
+		SetBase64Kernel(best);
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <QElapsedTimer>
+#include <QString>
+#include <QTextStream>
+
+
+/**
+ * Heap counters of the malloc hooks in Alloc.cpp, zero without glibc.
+ */
+qint64 AllocCount();
+qint64 HeapBytes();
+qint64 PeakHeapBytes();
+void ResetPeakHeap();
+
+/**
+ * Runs `f` for at least 0.5 s and writes one JSON line: operations per second,
+ * MB/s for `bytes` per operation, allocations per operation and the peak heap growth.
+ */
+template<typename F>
+void Run(QTextStream& out, const QString& name, qint64 bytes, F f)
+{
+	f(); // warm up
+	qint64 heap = HeapBytes();
+	ResetPeakHeap();
+	qint64 allocs = AllocCount();
+
+	QElapsedTimer timer;
+	timer.start();
+	qint64 count = 0;
+	do
+	{
+		f();
+		++count;
+	}
+	while (timer.elapsed() < 500);
+	double seconds = timer.nsecsElapsed() / 1e9;
+
+	out << "{\"bench\":\"" << name << "\",\"bytes\":" << bytes
+		<< ",\"ops_per_s\":" << count / seconds
+		<< ",\"mb_per_s\":" << bytes * count / seconds / 1e6
+		<< ",\"allocs_per_op\":" << double(AllocCount() - allocs) / count
+		<< ",\"peak_heap_bytes\":" << PeakHeapBytes() - heap << "}\n";
+	out.flush();
+}
+
+void BenchBase64(QTextStream& out);
+void BenchRfc2822(QTextStream& out, const QString& corpus);
+void BenchMail(QTextStream& out);
+void BenchSmtp(QTextStream& out);
+
+#endif // BENCH_HPP
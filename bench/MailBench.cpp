@@ -0,0 +1,84 @@
+#include "AttachmentNya.hpp"
+#include "CommonMail.hpp"
+#include "MailNya.hpp"
+
+#include "Bench.hpp"
+
+
+using namespace Nya;
+
+namespace
+{
+/**
+ * Text of about `size` chars; `special` words are mixed in every `every` words.
+ */
+QString Text(int size, const QString& special, int every)
+{
+	const char* words[] = { "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit" };
+	QString text;
+	for (int i = 0; text.size() < size; ++i)
+	{
+		text += (every && i % every == 0) ? special : QString(words[i % 8]);
+		text += (i % 12 == 11) ? "\n" : " ";
+	}
+	return text;
+}
+}
+
+/**
+ * Serialization of ASCII, quoted-printable and base64 bodies, attachment encoding
+ * with and without AttachmentCache, and header encoding.
+ */
+void BenchMail(QTextStream& out)
+{
+	QString cyrillic = QString::fromUtf8("\xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82");
+	for (int size : { 1024, 64 * 1024, 1024 * 1024 })
+	{
+		QString suffix = "." + QString::number(size);
+		QList<QPair<QString, QString>> bodies;
+		bodies << qMakePair(QString("ascii"), Text(size, QString(), 0));
+		bodies << qMakePair(QString("qp"), Text(size, cyrillic, 40));
+		bodies << qMakePair(QString("base64"), Text(size, cyrillic, 1));
+		for (const auto& body : bodies)
+		{
+			Mail mail("sender@example.com", "Benchmark", body.second);
+			mail.AddRecipient("rcpt@example.com");
+			Run(out, "mail.serialize." + body.first + suffix, body.second.size(), [&] {
+				mail.SetText(body.second); // drops the cached form
+				QByteArray data = mail;
+			});
+		}
+	}
+
+	int budget = AttachmentCache::Budget();
+	for (int size : { 1024, 64 * 1024, 1024 * 1024, 100 * 1024 * 1024 })
+	{
+		QString suffix = "." + QString::number(size);
+		QByteArray content(size, 'x');
+		Attachment attachment(&content, "application/octet-stream");
+
+		AttachmentCache::SetBudget(0);
+		Run(out, "attachment.mimedata" + suffix, size, [&] { attachment.MimeData(); });
+		if (size <= budget)
+		{
+			AttachmentCache::SetBudget(budget);
+			Run(out, "attachment.mimedata.cached" + suffix, size, [&] { attachment.MimeData(); });
+		}
+	}
+	AttachmentCache::SetBudget(budget);
+	AttachmentCache::Clear();
+
+	QList<QPair<QByteArray, QString>> headers;
+	headers << qMakePair(QByteArray("Subject"), QString("Re: [project] Build failed on master (#1234)"));
+	headers << qMakePair(QByteArray("To"), QString("Alice Example <alice@example.com>, Bob <bob@example.org>"));
+	headers << qMakePair(QByteArray("Subject"), QString::fromUtf8("\xd0\x9e\xd1\x82\xd1\x87\xd1\x91\xd1\x82 \xd0\xb7\xd0\xb0 \xd0\xbd\xd0\xb5\xd0\xb4\xd0\xb5\xd0\xbb\xd1\x8e"));
+	headers << qMakePair(QByteArray("From"), QString::fromUtf8("Ren\xc3\xa9 M\xc3\xbcller \xe2\x82\xac <rene@example.de>"));
+	qint64 bytes = 0;
+	for (const auto& header : headers) bytes += header.second.size();
+	Run(out, "header.guessencoding", bytes, [&] {
+		for (const auto& header : headers) GuessEncoding(header.second);
+	});
+	Run(out, "header.createentity", bytes, [&] {
+		for (const auto& header : headers) CreateEntity(header.first, header.second);
+	});
+}
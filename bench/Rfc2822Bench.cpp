@@ -0,0 +1,203 @@
+#include "AttachmentNya.hpp"
+#include "Base64.hpp"
+#include "MailNya.hpp"
+#include "Rfc2822.hpp"
+
+#include <QDir>
+#include <QFile>
+#include <QRegExp>
+#include <QTextCodec>
+
+#include "Bench.hpp"
+
+
+using namespace Nya;
+
+namespace
+{
+/**
+ * Header parsing as it was done before: a QRegExp match per line and per encoded word.
+ */
+class RegExpHeaders
+{
+	QByteArray currentHeaderKey;
+	QStringList currentHeaderValue;
+
+public:
+	void Parse(const QByteArray& buffer, QHash<QByteArray, QByteArray>& headers)
+	{
+		int pos = 0;
+		currentHeaderKey = QByteArray();
+		currentHeaderValue.clear();
+		while (true)
+		{
+			int crlfPos = buffer.indexOf("\r\n", pos);
+			if (crlfPos == -1) break;
+			if (crlfPos == pos)
+			{
+				ParseHeader("", headers);
+				break;
+			}
+			ParseHeader(buffer.mid(pos, crlfPos - pos), headers);
+			pos = crlfPos + 2;
+		}
+	}
+
+private:
+	void ParseHeader(const QByteArray& line, QHash<QByteArray, QByteArray>& headers)
+	{
+		QRegExp spRe("^[ \\t]");
+		QRegExp hdrRe("^([!-9;-~]+):[ \\t](.*)$");
+		if (spRe.indexIn(line) == 0)
+		{
+			currentHeaderValue.append(line);
+			return;
+		}
+		if (!currentHeaderKey.isEmpty())
+		{
+			headers[currentHeaderKey.toLower()] = UnfoldValue(currentHeaderValue).toUtf8();
+			currentHeaderKey = QByteArray();
+			currentHeaderValue.clear();
+		}
+		if (hdrRe.exactMatch(line))
+		{
+			currentHeaderKey = hdrRe.cap(1).toUtf8();
+			currentHeaderValue.append(hdrRe.cap(2));
+		}
+	}
+
+	static QString UnfoldValue(QStringList& folded)
+	{
+		QRegExp encRe("=\\?([^? \\t]+)\\?([qQbB])\\?([^? \\t]+)\\?=");
+		for (QStringList::iterator i = folded.begin(); i != folded.end(); ++i)
+		{
+			int offset = 0;
+			while (encRe.indexIn(*i, offset) != -1)
+			{
+				QString decoded = Decode(encRe.cap(1), encRe.cap(2).toLower(), encRe.cap(3));
+				i->replace(encRe.pos(), encRe.matchedLength(), decoded);
+				offset = encRe.pos() + decoded.length();
+			}
+		}
+		return folded.join("");
+	}
+
+	static QString Decode(const QString& charset, const QString& encoding, const QString& encoded)
+	{
+		QByteArray buf;
+		if (encoding == "q")
+		{
+			QByteArray src = encoded.toLatin1();
+			int len = src.length();
+			for (int i = 0; i < len; i++)
+			{
+				if (src[i] == '_') buf += 0x20;
+				else if (src[i] == '=')
+				{
+					if (i+2 < len)
+					{
+						buf += QByteArray::fromHex(src.mid(i+1,2));
+						i += 2;
+					}
+				}
+				else buf += src[i];
+			}
+		}
+		else if (encoding == "b")
+		{
+			buf = FromBase64(encoded.toLatin1());
+		}
+		QTextCodec *codec = QTextCodec::codecForName(charset.toLatin1());
+		return codec ? codec->toUnicode(buf) : QString();
+	}
+};
+
+/**
+ * A bounce: deep Received chain, folded and encoded headers, short body.
+ */
+QByteArray BounceMessage(int received)
+{
+	QByteArray message;
+	for (int i = 0; i < received; ++i)
+	{
+		message += "Received: from relay" + QByteArray::number(i) + ".example.org (relay" + QByteArray::number(i)
+			+ ".example.org [192.0.2." + QByteArray::number(i % 250) + "])\r\n"
+			"\tby mx.example.com with ESMTPS id 4Fh2kX" + QByteArray::number(i) + "\r\n"
+			"\tfor <user@example.com>; Tue, 13 Oct 2026 09:41:" + QByteArray::number(10 + i % 50) + " +0000\r\n";
+	}
+	message +=
+		"From: Mail Delivery System <MAILER-DAEMON@example.com>\r\n"
+		"To: =?UTF-8?B?0JjQstCw0L0g0J/QtdGC0YDQvtCy?= <ivan@example.com>\r\n"
+		"Subject: =?ISO-8859-1?Q?Unzustellbar:_R=FCckmeldung?=\r\n"
+		" =?ISO-8859-1?Q?_zur_Bestellung?=\r\n"
+		"Date: Tue, 13 Oct 2026 09:42:00 +0000\r\n"
+		"Message-ID: <20261013094200.1234@example.com>\r\n"
+		"MIME-Version: 1.0\r\n"
+		"Content-Type: text/plain; charset=us-ascii\r\n"
+		"Auto-Submitted: auto-replied\r\n"
+		"\r\n"
+		"This is the mail system at host example.com.\r\n";
+	return message;
+}
+
+/**
+ * Plain, bounce and multipart messages with attachments, as the library writes them.
+ */
+QList<QByteArray> SyntheticCorpus()
+{
+	QList<QByteArray> messages;
+	Mail plain("sender@example.com", "Weekly report", QString("All systems nominal. ").repeated(200));
+	plain.AddRecipient("team@example.com");
+	messages << plain << BounceMessage(32);
+
+	for (int size : { 4 * 1024, 256 * 1024 })
+	{
+		Mail mail("sender@example.com", "Invoice", "Please find the invoice attached.");
+		mail.AddRecipient("customer@example.com");
+		QByteArray pdf(size, 'x');
+		mail.AddAttachment("invoice.pdf", new Attachment(&pdf, "application/pdf"));
+		mail.AddAttachment("logo.png", new Attachment(&pdf, "image/png"));
+		messages << mail;
+	}
+	return messages;
+}
+}
+
+/**
+ * Header section against the previous parser, and whole messages through Mail.
+ * Without a corpus directory a synthetic one is used.
+ */
+void BenchRfc2822(QTextStream& out, const QString& corpus)
+{
+	for (int received : { 4, 32, 256 })
+	{
+		QByteArray message = BounceMessage(received);
+		QString suffix = "." + QString::number(received);
+		Run(out, "rfc2822.headers.qregexp" + suffix, message.size(), [&] {
+			QHash<QByteArray, QByteArray> headers;
+			RegExpHeaders().Parse(message, headers);
+		});
+		Run(out, "rfc2822.headers.tokenizer" + suffix, message.size(), [&] {
+			QHash<QByteArray, QByteArray> headers;
+			Rfc2822::ParseHeaders(message, 0, headers);
+		});
+	}
+
+	QList<QByteArray> messages;
+	if (!corpus.isEmpty())
+	{
+		QDir dir(corpus);
+		for (const QString& name : dir.entryList(QStringList() << "*.eml", QDir::Files, QDir::Name))
+		{
+			QFile file(dir.filePath(name));
+			if (file.open(QIODevice::ReadOnly)) messages.append(file.readAll());
+		}
+	}
+	if (messages.isEmpty()) messages = SyntheticCorpus();
+
+	qint64 bytes = 0;
+	for (const QByteArray& message : messages) bytes += message.size();
+	Run(out, "rfc2822.parse", bytes, [&] {
+		for (const QByteArray& message : messages) Mail mail(message);
+	});
+}
@@ -0,0 +1,42 @@
+#include "SmtpNya.hpp"
+
+#include "Bench.hpp"
+
+
+using namespace Nya;
+
+/**
+ * Reply parsing of Smtp::OnSocketRead on an EHLO reply and pipelined transactions.
+ */
+void BenchSmtp(QTextStream& out)
+{
+	QByteArray ehlo =
+		"250-mx.example.com Hello client.example.org [192.0.2.1]\r\n"
+		"250-SIZE 52428800\r\n"
+		"250-8BITMIME\r\n"
+		"250-PIPELINING\r\n"
+		"250-CHUNKING\r\n"
+		"250-SMTPUTF8\r\n"
+		"250-ENHANCEDSTATUSCODES\r\n"
+		"250-AUTH PLAIN LOGIN CRAM-MD5\r\n"
+		"250 STARTTLS\r\n";
+	QByteArray transaction =
+		"250 2.1.0 Sender OK\r\n"
+		"250 2.1.5 Recipient OK\r\n"
+		"250 2.1.5 Recipient OK\r\n"
+		"354 Start mail input; end with <CRLF>.<CRLF>\r\n"
+		"250 2.0.0 Ok: queued as 4Fh2kX1234\r\n";
+
+	QList<QPair<QString, QByteArray>> inputs;
+	inputs << qMakePair(QString("smtp.replies.ehlo"), ehlo);
+	inputs << qMakePair(QString("smtp.replies.pipelined"), transaction.repeated(100));
+	for (const auto& input : inputs)
+	{
+		Run(out, input.first, input.second.size(), [&] {
+			SmtpReply reply;
+			int pos = 0;
+			int next;
+			while ((next = Smtp::NextReply(input.second, pos, reply)) != -1) pos = next;
+		});
+	}
+}
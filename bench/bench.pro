@@ -0,0 +1,18 @@
+QT = core network
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+TARGET = nya_bench
+
+include(../nya_smtp_lib.pri)
+
+SOURCES += \
+	main.cpp \
+	Alloc.cpp \
+	Base64Bench.cpp \
+	MailBench.cpp \
+	Rfc2822Bench.cpp \
+	SmtpBench.cpp
+
+HEADERS += \
+	Bench.hpp
@@ -0,0 +1,38 @@
+#include "Bench.hpp"
+
+#include <QCoreApplication>
+#include <QStringList>
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+
+/**
+ * Runs all benchmarks, or the ones named in the arguments.
+ * One JSON object per line, `--corpus DIR` parses the .eml files in DIR too.
+ */
+int main(int argc, char* argv[])
+{
+	QCoreApplication app(argc, argv);
+	QStringList names = app.arguments().mid(1);
+	QString corpus;
+	int corpusArg = names.indexOf("--corpus");
+	if (corpusArg != -1 && corpusArg + 1 < names.size())
+	{
+		corpus = names[corpusArg + 1];
+		names.erase(names.begin() + corpusArg, names.begin() + corpusArg + 2);
+	}
+	QTextStream out(stdout);
+
+	if (names.isEmpty() || names.contains("base64")) BenchBase64(out);
+	if (names.isEmpty() || names.contains("rfc2822")) BenchRfc2822(out, corpus);
+	if (names.isEmpty() || names.contains("mail")) BenchMail(out);
+	if (names.isEmpty() || names.contains("smtp")) BenchSmtp(out);
+
+#ifdef Q_OS_UNIX
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	out << "{\"bench\":\"process\",\"max_rss_kb\":" << usage.ru_maxrss << "}\n";
+#endif
+	return 0;
+}
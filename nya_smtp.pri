@@ -0,0 +1,27 @@
+INCLUDEPATH += $$PWD/src
+
+HEADERS += \
+	$$PWD/src/SmtpNya.hpp \
+	$$PWD/src/AttachmentNya.hpp \
+	$$PWD/src/MailNya.hpp \
+	$$PWD/src/Rfc2822.hpp \
+	$$PWD/src/CommonMail.hpp \
+	$$PWD/src/MailStreamNya.hpp \
+	$$PWD/src/MailParserNya.hpp \
+	$$PWD/src/MailImporterNya.hpp \
+	$$PWD/src/MailTemplateNya.hpp \
+	$$PWD/src/MailSpoolNya.hpp \
+	$$PWD/src/Base64.hpp
+
+SOURCES += \
+	$$PWD/src/SmtpNya.cpp \
+	$$PWD/src/AttachmentNya.cpp \
+	$$PWD/src/MailNya.cpp \
+	$$PWD/src/Rfc2822.cpp \
+	$$PWD/src/CommonMail.cpp \
+	$$PWD/src/MailStreamNya.cpp \
+	$$PWD/src/MailParserNya.cpp \
+	$$PWD/src/MailImporterNya.cpp \
+	$$PWD/src/MailTemplateNya.cpp \
+	$$PWD/src/MailSpoolNya.cpp \
+	$$PWD/src/Base64.cpp
@@ -1,17 +1,14 @@
-QT = core network
-TEMPLATE = lib
+TEMPLATE = subdirs
 
+SUBDIRS = \
+	src \
+	bench \
+	loadgen \
+	tests
 
-HEADERS += \
-	src/SmtpNya.hpp \
-	src/AttachmentNya.hpp \
-	src/MailNya.hpp \
-	src/Rfc2822.hpp \
-	src/CommonMail.hpp
+loadgen.subdir = tools/loadgen
 
-SOURCES += \
-	src/SmtpNya.cpp \
-	src/AttachmentNya.cpp \
-	src/MailNya.cpp \
-	src/Rfc2822.cpp \
-	src/CommonMail.cpp
+# the apps link the static library built in src
+bench.depends = src
+loadgen.depends = src
+tests.depends = src
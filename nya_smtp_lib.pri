@@ -0,0 +1,13 @@
+# Links the static library of src.pro, for the projects of this tree.
+# Other projects can include nya_smtp.pri and build the sources themselves.
+
+INCLUDEPATH += $$PWD/src
+DEPENDPATH += $$PWD/src
+
+NYA_SMTP_LIBDIR = $$shadowed($$PWD/src)
+win32:CONFIG(release, debug|release): NYA_SMTP_LIBDIR = $$NYA_SMTP_LIBDIR/release
+else:win32:CONFIG(debug, debug|release): NYA_SMTP_LIBDIR = $$NYA_SMTP_LIBDIR/debug
+
+LIBS += -L$$NYA_SMTP_LIBDIR -lnya_smtp
+win32-msvc*: PRE_TARGETDEPS += $$NYA_SMTP_LIBDIR/nya_smtp.lib
+else: PRE_TARGETDEPS += $$NYA_SMTP_LIBDIR/libnya_smtp.a
@@ -1,8 +1,18 @@
+#include "Base64.hpp"
 #include "CommonMail.hpp"
 #include "MailNya.hpp"
 
 #include <QBuffer>
+#include <QCache>
+#include <QCryptographicHash>
+#include <QAbstractSocket>
+#include <QDateTime>
 #include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QProcess>
+#include <cstring>
 
 #include "AttachmentNya.hpp"
 
@@ -39,27 +49,279 @@ Attachment::~Attachment()
 {}
 
 /**
- * Mime data.
+ * Mime headers of the part, including the empty line.
  */
-QByteArray Attachment::MimeData() const
+QByteArray Attachment::MimeHeader(bool isBinary) const
 {
-	QByteArray data = "Content-Type: " + contentType + "\r\nContent-Transfer-Encoding: base64\r\n";
+	QByteArray data = "Content-Type: " + contentType + "\r\nContent-Transfer-Encoding: ";
+	data += isBinary ? "binary\r\n" : "base64\r\n";
 	for (auto i = extraHeaders.begin(); i != extraHeaders.end(); ++i )
 	{
 		data += CreateEntity(i.key(), i.value());
 	}
 	data += "\r\n";
+	return data;
+}
+
+/**
+ * Mime data, empty if the content could not be read to its end.
+ */
+QByteArray Attachment::MimeData() const
+{
+	QByteArray data = MimeHeader();
+	QByteArray encoded;
+	if (AttachmentCache::Encode(*this, encoded)) data += encoded;
+	else if (!EncodeBody(data)) return QByteArray();
+	return data;
+}
+
+/**
+ * Append the base64 content to data.
+ * Returns false if the content could not be read to its end.
+ */
+bool Attachment::EncodeBody(QByteArray& data) const
+{
+	if (content && !content->isSequential())
+	{
+		data.reserve(data.size() + (content->size() + 56) / 57 * AttachmentEncoder::LineSize);
+	}
 
-	if (content)
+	AttachmentEncoder encoder(*this);
+	while (!encoder.AtEnd())
+	{
+		int pos = data.size();
+		data.resize(pos + AttachmentEncoder::BlockSize / 57 * AttachmentEncoder::LineSize);
+		data.resize(pos + encoder.Read(data.data() + pos, data.size() - pos));
+	}
+	return !encoder.IsFailed();
+}
+
+/**
+ * Key of the content for AttachmentCache: path, size and modification time of files,
+ * a hash of in-memory content. Empty for other devices.
+ */
+QByteArray Attachment::CacheKey() const
+{
+	if (QFile* file = qobject_cast<QFile*>(content.get()))
+	{
+		QFileInfo info(file->fileName());
+		if (!info.isFile()) return QByteArray();
+		return "f:" + info.absoluteFilePath().toUtf8() + ':' + QByteArray::number(info.size())
+			+ ':' + QByteArray::number(info.lastModified().toMSecsSinceEpoch());
+	}
+	if (QBuffer* buffer = qobject_cast<QBuffer*>(content.get()))
 	{
-		content->open(QIODevice::ReadOnly);
-		QByteArray contentData = content->readAll();
-		for (int pos = 0; pos < contentData.length(); pos += 57)
+		if (contentHash.isEmpty())
 		{
-			data += contentData.mid(pos, 57).toBase64() + "\r\n";
+			contentHash = "h:" + QCryptographicHash::hash(buffer->data(), QCryptographicHash::Sha256).toHex()
+				+ ':' + QByteArray::number(buffer->data().size());
 		}
-		content->close();
+		return contentHash;
 	}
-	return data;
+	return QByteArray();
+}
+
+/**
+ * Write mime data to the sink without keeping the content in memory.
+ * Returns the number of bytes written or -1 on error.
+ */
+qint64 Attachment::WriteMimeData(QIODevice* sink) const
+{
+	QByteArray header = MimeHeader();
+	if (sink->write(header) != header.size()) return -1;
+
+	AttachmentEncoder encoder(*this);
+	qint64 written = encoder.WriteTo(sink);
+	return (written < 0) ? -1 : header.size() + written;
+}
+
+//==============================================================================
+/**
+ * The sequential device will not produce more data.
+ */
+static bool IsFinished(const QIODevice& device)
+{
+	if (const QProcess* process = qobject_cast<const QProcess*>(&device)) return process->state() == QProcess::NotRunning;
+	if (const QAbstractSocket* socket = qobject_cast<const QAbstractSocket*>(&device))
+	{
+		return socket->state() != QAbstractSocket::ConnectedState;
+	}
+	return !device.isOpen();
+}
+
+AttachmentEncoder::AttachmentEncoder(const Attachment& attachment, bool isBinary, int timeout)
+	: device(attachment.content)
+	, block(BlockSize, 0)
+	, isBinary(isBinary)
+	, timeout(timeout)
+{
+	if (!device)
+	{
+		isEnd = true;
+		return;
+	}
+
+	if (!device->isOpen())
+	{
+		isOpened = device->open(QIODevice::ReadOnly);
+		if (!isOpened) isFailed = isEnd = true; // a missing file is not an empty one
+	}
+	else if (!device->isSequential())
+	{
+		device->seek(0);
+	}
+}
+
+AttachmentEncoder::~AttachmentEncoder()
+{
+	if (isOpened) device->close();
+}
+
+/**
+ * Encode whole lines into `out`, at most maxSize bytes.
+ * maxSize must fit at least one line.
+ * Returns the number of bytes written.
+ */
+int AttachmentEncoder::Read(char* out, int maxSize)
+{
+	int size = 0;
+	if (isBinary)
+	{
+		while (size < maxSize)
+		{
+			if (blockPos == blockLen && !isEnd) Fill();
+			int len = qMin(maxSize - size, blockLen - blockPos);
+			if (len == 0) break;
+
+			memcpy(out + size, block.constData() + blockPos, len);
+			size += len;
+			blockPos += len;
+		}
+		return size;
+	}
+
+	while (maxSize - size >= LineSize)
+	{
+		if (blockLen - blockPos < 57 && !isEnd) Fill();
+		int available = blockLen - blockPos;
+		if (available == 0) break;
+
+		// a short line is only allowed at the end
+		int len = qMin(available, (maxSize - size) / LineSize * 57);
+		if (!isEnd) len -= len % 57;
+
+		size += Base64Encode(block.constData() + blockPos, len, out + size, true);
+		blockPos += len;
+	}
+	return size;
+}
+
+/**
+ * Encode everything left to the sink.
+ * Returns the number of bytes written or -1 on error.
+ */
+qint64 AttachmentEncoder::WriteTo(QIODevice* sink)
+{
+	QByteArray buffer(BlockSize / 57 * LineSize, 0);
+	qint64 written = 0;
+	while (!AtEnd())
+	{
+		int size = Read(buffer.data(), buffer.size());
+		if (sink->write(buffer.constData(), size) != size) return -1;
+		written += size;
+	}
+	return isFailed ? -1 : written;
+}
+
+/**
+ * Read the next block of the device, keeping the unencoded rest.
+ */
+void AttachmentEncoder::Fill()
+{
+	int rest = blockLen - blockPos;
+	memmove(block.data(), block.constData() + blockPos, rest);
+	blockPos = 0;
+	blockLen = rest;
+
+	while (blockLen < BlockSize)
+	{
+		qint64 size = device->read(block.data() + blockLen, BlockSize - blockLen);
+		if (size > 0)
+		{
+			blockLen += size;
+			// do not wait on pipes while there is something to encode
+			if (device->isSequential() && blockLen >= 57) break;
+			continue;
+		}
+		if (size == 0 && !device->isSequential()) // end of file
+		{
+			isEnd = true;
+			break;
+		}
+		if (size < 0)
+		{
+			isFailed = true;
+			isEnd = true;
+			break;
+		}
+		if (!device->waitForReadyRead(timeout))
+		{
+			// nothing more from a finished process or a closed socket, anything still running timed out
+			isFailed = !IsFinished(*device);
+			isEnd = true;
+			break;
+		}
+	}
+}
+
+//==============================================================================
+static QMutex cacheMutex;
+static QCache<QByteArray, QByteArray> cache(64 * 1024 * 1024);
+
+/**
+ * Base64 body of the attachment from the cache, encoded and added on a miss.
+ * Returns false if the content cannot be cached or is over the budget.
+ * Concurrent misses on the same content may both encode it.
+ */
+bool AttachmentCache::Encode(const Attachment& attachment, QByteArray& encoded)
+{
+	QByteArray key = attachment.CacheKey();
+	if (key.isEmpty()) return false;
+	{
+		QMutexLocker locker(&cacheMutex);
+		if (QByteArray* cached = cache.object(key))
+		{
+			encoded = *cached;
+			return true;
+		}
+		if ((attachment.content->size() + 56) / 57 * AttachmentEncoder::LineSize > cache.maxCost()) return false;
+	}
+
+	encoded.clear();
+	if (!attachment.EncodeBody(encoded)) return false;
+	QMutexLocker locker(&cacheMutex);
+	cache.insert(key, new QByteArray(encoded), encoded.size());
+	return true;
+}
+
+/**
+ * Memory budget in bytes, least recently used bodies are dropped to stay within it.
+ */
+void AttachmentCache::SetBudget(int bytes)
+{
+	QMutexLocker locker(&cacheMutex);
+	cache.setMaxCost(bytes);
+}
+
+int AttachmentCache::Budget()
+{
+	QMutexLocker locker(&cacheMutex);
+	return cache.maxCost();
+}
+
+void AttachmentCache::Clear()
+{
+	QMutexLocker locker(&cacheMutex);
+	cache.clear();
 }
 }
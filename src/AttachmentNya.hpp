@@ -12,8 +12,14 @@ namespace Nya
 {
 class Attachment
 {
+	friend class AttachmentEncoder;
+	friend class AttachmentCache;
+	friend class Mail;
+	friend class MailImporter;
+
 	QByteArray contentType;
 	mutable s_p<QIODevice> content;
+	mutable QByteArray contentHash;
 	QHash<QByteArray, QByteArray> extraHeaders;
 
 public:
@@ -28,7 +34,62 @@ public:
 
 	void SetContentType(const QByteArray& contentType) { this->contentType = contentType;}
 
+	QByteArray MimeHeader(bool isBinary = false) const;
 	QByteArray MimeData() const;
+	qint64 WriteMimeData(QIODevice* sink) const;
+
+private:
+	bool EncodeBody(QByteArray& data) const;
+	QByteArray CacheKey() const;
+};
+
+/**
+ * Process-wide LRU cache of base64 attachment bodies within a memory budget, 64 MB by default.
+ * Attachments with the same file or the same in-memory content share one entry.
+ */
+class AttachmentCache
+{
+public:
+	static bool Encode(const Attachment& attachment, QByteArray& encoded);
+	static void SetBudget(int bytes);
+	static int Budget();
+	static void Clear();
+};
+
+/**
+ * Base64 encoder reading the attachment device in fixed blocks.
+ * Encoded lines are written straight into the caller's buffer,
+ * or the raw content for binary transfer.
+ * Sequential devices (pipes, QProcess) are read until they are finished,
+ * waiting at most `timeout` ms for each block. A device that cannot be opened,
+ * a timeout or a read error ends the encoder with IsFailed(), the output is then incomplete.
+ */
+class AttachmentEncoder
+{
+	s_p<QIODevice> device;
+	QByteArray block;
+	int blockPos = 0;
+	int blockLen = 0;
+	bool isOpened = false;
+	bool isEnd = false;
+	bool isFailed = false;
+	bool isBinary;
+	int timeout;
+
+public:
+	static const int BlockSize = 57 * 1024; // raw bytes read at once
+	static const int LineSize = 78; // 76 chars + CRLF
+
+	AttachmentEncoder(const Attachment& attachment, bool isBinary = false, int timeout = 30000);
+	~AttachmentEncoder();
+
+	bool AtEnd() const { return isEnd && blockPos == blockLen; }
+	bool IsFailed() const { return isFailed; }
+	int Read(char* out, int maxSize);
+	qint64 WriteTo(QIODevice* sink);
+
+private:
+	void Fill();
 };
 
 }
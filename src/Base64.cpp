@@ -0,0 +1,461 @@
+#include "Base64.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#    define NYA_BASE64_X86
+#    define NYA_TARGET(x) __attribute__((target(x)))
+#    include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#    define NYA_BASE64_X86
+#    define NYA_TARGET(x)
+#    include <immintrin.h>
+#    include <intrin.h>
+#endif
+
+
+namespace Nya
+{
+static const char encodeTable[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+struct DecodeTable
+{
+	signed char value[256];
+
+	DecodeTable()
+	{
+		for (int i = 0; i < 256; ++i) value[i] = -1;
+		for (int i = 0; i < 64; ++i) value[uchar(encodeTable[i])] = char(i);
+	}
+};
+static const DecodeTable decodeTable;
+
+//==============================================================================
+/**
+ * Encode whole 3-byte groups and the padded rest.
+ */
+static char* EncodeScalar(const uchar* in, int len, char* out)
+{
+	for (; len >= 3; len -= 3, in += 3)
+	{
+		*out++ = encodeTable[in[0] >> 2];
+		*out++ = encodeTable[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+		*out++ = encodeTable[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
+		*out++ = encodeTable[in[2] & 0x3f];
+	}
+	if (len)
+	{
+		*out++ = encodeTable[in[0] >> 2];
+		if (len == 1)
+		{
+			*out++ = encodeTable[(in[0] & 0x03) << 4];
+			*out++ = '=';
+		}
+		else
+		{
+			*out++ = encodeTable[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+			*out++ = encodeTable[(in[1] & 0x0f) << 2];
+		}
+		*out++ = '=';
+	}
+	return out;
+}
+
+/**
+ * Decoder state between the vectorized blocks.
+ * Like QByteArray::fromBase64, chars outside of the alphabet (CRLF, '=') are skipped.
+ */
+struct DecodeState
+{
+	uint bits = 0;
+	int nbits = 0;
+	int count = 0; // alphabet chars since the last whole group
+};
+
+static char* DecodeScalar(const uchar* in, int len, char* out, DecodeState& state)
+{
+	for (int i = 0; i < len; ++i)
+	{
+		int d = decodeTable.value[in[i]];
+		if (d < 0) continue;
+
+		state.bits = (state.bits << 6) | d;
+		state.nbits += 6;
+		if (state.nbits >= 8)
+		{
+			state.nbits -= 8;
+			*out++ = char(state.bits >> state.nbits);
+			state.bits &= (1 << state.nbits) - 1;
+		}
+		state.count = (state.count + 1) & 3;
+	}
+	return out;
+}
+
+//==============================================================================
+#ifdef NYA_BASE64_X86
+// Vector kernels after W. Mula and D. Lemire, "Faster Base64 Encoding and Decoding Using AVX2 Instructions".
+
+NYA_TARGET("sse4.1")
+static inline __m128i EncodeReshuffle128(__m128i in)
+{
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	__m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	__m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	__m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	__m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(t1, t3);
+}
+
+NYA_TARGET("sse4.1")
+static inline __m128i EncodeTranslate128(__m128i in)
+{
+	const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	__m128i indices = _mm_subs_epu8(in, _mm_set1_epi8(51));
+	__m128i mask = _mm_cmpgt_epi8(in, _mm_set1_epi8(25));
+	indices = _mm_sub_epi8(indices, mask);
+	return _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+}
+
+/**
+ * 12 bytes to 16 chars, reads 16 bytes.
+ */
+NYA_TARGET("sse4.1")
+static inline void EncodeBlockSse41(const uchar* in, char* out)
+{
+	__m128i v = _mm_loadu_si128((const __m128i*)in);
+	_mm_storeu_si128((__m128i*)out, EncodeTranslate128(EncodeReshuffle128(v)));
+}
+
+NYA_TARGET("avx2")
+static inline __m256i EncodeReshuffle256(__m256i in)
+{
+	in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	__m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+	__m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+	__m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+	__m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+	return _mm256_or_si256(t1, t3);
+}
+
+NYA_TARGET("avx2")
+static inline __m256i EncodeTranslate256(__m256i in)
+{
+	const __m256i lut = _mm256_setr_epi8(
+		65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+		65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	__m256i indices = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+	__m256i mask = _mm256_cmpgt_epi8(in, _mm256_set1_epi8(25));
+	indices = _mm256_sub_epi8(indices, mask);
+	return _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, indices));
+}
+
+/**
+ * 24 bytes to 32 chars, reads 28 bytes.
+ */
+NYA_TARGET("avx2")
+static inline void EncodeBlockAvx2(const uchar* in, char* out)
+{
+	__m256i v = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)in));
+	v = _mm256_inserti128_si256(v, _mm_loadu_si128((const __m128i*)(in + 12)), 1);
+	_mm256_storeu_si256((__m256i*)out, EncodeTranslate256(EncodeReshuffle256(v)));
+}
+
+NYA_TARGET("sse4.1")
+static char* EncodeSse41(const uchar* in, int len, char* out)
+{
+	for (; len >= 16; len -= 12, in += 12, out += 16) EncodeBlockSse41(in, out);
+	return EncodeScalar(in, len, out);
+}
+
+NYA_TARGET("avx2")
+static char* EncodeAvx2(const uchar* in, int len, char* out)
+{
+	for (; len >= 32; len -= 24, in += 24, out += 32) EncodeBlockAvx2(in, out);
+	return EncodeSse41(in, len, out);
+}
+
+/**
+ * One 57-byte line to 76 chars, reads 64 bytes and writes 80 chars.
+ * The last block overlaps the next line, its extra chars are overwritten by CRLF.
+ */
+NYA_TARGET("sse4.1")
+static void EncodeLineSse41(const uchar* in, char* out)
+{
+	for (int i = 0; i < 5; ++i) EncodeBlockSse41(in + i * 12, out + i * 16);
+}
+
+NYA_TARGET("avx2")
+static void EncodeLineAvx2(const uchar* in, char* out)
+{
+	EncodeBlockAvx2(in, out);
+	EncodeBlockAvx2(in + 24, out + 32);
+	EncodeBlockSse41(in + 48, out + 64);
+}
+
+NYA_TARGET("sse4.1")
+static inline __m128i DecodeReshuffle128(__m128i in)
+{
+	__m128i merged = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+	__m128i out = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(out, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+/**
+ * 16 chars to 12 bytes, writes 16 bytes.
+ * Returns the mask of chars outside of the alphabet, nothing is written then.
+ */
+NYA_TARGET("sse4.1")
+static inline int DecodeBlockSse41(const uchar* in, char* out)
+{
+	const __m128i lutLo = _mm_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m128i lutHi = _mm_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask2F = _mm_set1_epi8(0x2f);
+
+	__m128i v = _mm_loadu_si128((const __m128i*)in);
+	__m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(v, 4), mask2F);
+	__m128i loNibbles = _mm_and_si128(v, mask2F);
+	__m128i hi = _mm_shuffle_epi8(lutHi, hiNibbles);
+	__m128i lo = _mm_shuffle_epi8(lutLo, loNibbles);
+	int invalid = _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128()));
+	if (invalid) return invalid;
+
+	__m128i eq2F = _mm_cmpeq_epi8(v, mask2F);
+	__m128i roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(eq2F, hiNibbles));
+	_mm_storeu_si128((__m128i*)out, DecodeReshuffle128(_mm_add_epi8(v, roll)));
+	return 0;
+}
+
+/**
+ * 32 chars to 24 bytes, writes 32 bytes.
+ */
+NYA_TARGET("avx2")
+static inline uint DecodeBlockAvx2(const uchar* in, char* out)
+{
+	const __m256i lutLo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lutHi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lutRoll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask2F = _mm256_set1_epi8(0x2f);
+
+	__m256i v = _mm256_loadu_si256((const __m256i*)in);
+	__m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask2F);
+	__m256i loNibbles = _mm256_and_si256(v, mask2F);
+	__m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+	__m256i lo = _mm256_shuffle_epi8(lutLo, loNibbles);
+	uint invalid = uint(_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256())));
+	if (invalid) return invalid;
+
+	__m256i eq2F = _mm256_cmpeq_epi8(v, mask2F);
+	__m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(eq2F, hiNibbles));
+	v = _mm256_add_epi8(v, roll);
+
+	__m256i merged = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+	v = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+	v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+	_mm256_storeu_si256((__m256i*)out, v);
+	return 0;
+}
+
+static inline int FirstBit(uint mask)
+{
+#    ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return int(index);
+#    else
+	return __builtin_ctz(mask);
+#    endif
+}
+
+/**
+ * Blocks without CRLF or padding go the vector way, anything else is decoded
+ * by the scalar loop up to and including the first char outside of the alphabet.
+ */
+NYA_TARGET("sse4.1")
+static char* DecodeSse41(const uchar* in, int len, char* out, DecodeState& state)
+{
+	while (len >= 16)
+	{
+		int invalid = state.count ? 1 : DecodeBlockSse41(in, out);
+		if (!invalid)
+		{
+			in += 16;
+			len -= 16;
+			out += 12;
+			continue;
+		}
+		int n = state.count ? 1 : FirstBit(uint(invalid)) + 1;
+		out = DecodeScalar(in, n, out, state);
+		in += n;
+		len -= n;
+	}
+	return DecodeScalar(in, len, out, state);
+}
+
+NYA_TARGET("avx2")
+static char* DecodeAvx2(const uchar* in, int len, char* out, DecodeState& state)
+{
+	while (len >= 32)
+	{
+		uint invalid = state.count ? 1 : DecodeBlockAvx2(in, out);
+		if (!invalid)
+		{
+			in += 32;
+			len -= 32;
+			out += 24;
+			continue;
+		}
+		int n = state.count ? 1 : FirstBit(invalid) + 1;
+		if (n > 16 && !DecodeBlockSse41(in, out))
+		{
+			// the first half is fine, e.g. a line break in the second one
+			in += 16;
+			len -= 16;
+			out += 12;
+			n -= 16;
+		}
+		out = DecodeScalar(in, n, out, state);
+		in += n;
+		len -= n;
+	}
+	return DecodeSse41(in, len, out, state);
+}
+
+static Base64Kernel DetectKernel()
+{
+#    ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+	__cpuid(info, 1);
+	bool hasSse41 = (info[2] & (1 << 19)) != 0;
+	bool hasAvx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6);
+	bool hasAvx2 = false;
+	if (hasAvx && maxLeaf >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		hasAvx2 = (info[1] & (1 << 5)) != 0;
+	}
+#    else
+	__builtin_cpu_init();
+	bool hasSse41 = __builtin_cpu_supports("sse4.1");
+	bool hasAvx2 = __builtin_cpu_supports("avx2");
+#    endif
+	if (hasAvx2) return Base64Avx2;
+	if (hasSse41) return Base64Sse41;
+	return Base64Scalar;
+}
+#endif
+
+//==============================================================================
+static Base64Kernel BestKernel()
+{
+#ifdef NYA_BASE64_X86
+	static const Base64Kernel best = DetectKernel();
+	return best;
+#else
+	return Base64Scalar;
+#endif
+}
+
+static Base64Kernel currentKernel = BestKernel();
+
+/**
+ * Kernel used by the encoder and decoder, the best one supported by the cpu.
+ */
+Base64Kernel GetBase64Kernel()
+{
+	return currentKernel;
+}
+
+/**
+ * Force a slower kernel (for benchmarks).
+ * Kernels unsupported by the cpu are ignored.
+ */
+void SetBase64Kernel(Base64Kernel kernel)
+{
+	if (kernel <= BestKernel()) currentKernel = kernel;
+}
+
+/**
+ * Encode `len` bytes into `out`, it must have Base64EncodedSize() bytes.
+ * Returns the number of chars written.
+ */
+int Base64Encode(const char* in, int len, char* out, bool isWrapped)
+{
+	const uchar* src = (const uchar*)in;
+	char* dst = out;
+	Base64Kernel kernel = currentKernel;
+	if (!isWrapped)
+	{
+#ifdef NYA_BASE64_X86
+		if (kernel == Base64Avx2) return int(EncodeAvx2(src, len, dst) - out);
+		if (kernel == Base64Sse41) return int(EncodeSse41(src, len, dst) - out);
+#endif
+		return int(EncodeScalar(src, len, dst) - out);
+	}
+
+	for (; len > 0; len -= 57, src += 57)
+	{
+		int lineLen = (len < 57) ? len : 57;
+#ifdef NYA_BASE64_X86
+		// vector lines read 7 bytes and write 2 chars past the line, the next line has them
+		if (len >= 64 && kernel == Base64Avx2) { EncodeLineAvx2(src, dst); dst += 76; }
+		else if (len >= 64 && kernel == Base64Sse41) { EncodeLineSse41(src, dst); dst += 76; }
+		else
+#endif
+			dst = EncodeScalar(src, lineLen, dst);
+		*dst++ = '\r';
+		*dst++ = '\n';
+	}
+	return int(dst - out);
+}
+
+/**
+ * Decode `len` chars into `out`, it must have Base64DecodedBound() bytes.
+ * Chars outside of the alphabet are skipped, like QByteArray::fromBase64 does.
+ * Returns the number of bytes written.
+ */
+int Base64Decode(const char* in, int len, char* out)
+{
+	const uchar* src = (const uchar*)in;
+	DecodeState state;
+#ifdef NYA_BASE64_X86
+	if (currentKernel == Base64Avx2) return int(DecodeAvx2(src, len, out, state) - out);
+	if (currentKernel == Base64Sse41) return int(DecodeSse41(src, len, out, state) - out);
+#endif
+	return int(DecodeScalar(src, len, out, state) - out);
+}
+
+/**
+ * Base64, wrapped at 76 chars with CRLF if isWrapped.
+ */
+QByteArray ToBase64(const QByteArray& data, bool isWrapped)
+{
+	QByteArray base64(Base64EncodedSize(data.size(), isWrapped), Qt::Uninitialized);
+	Base64Encode(data.constData(), data.size(), base64.data(), isWrapped);
+	return base64;
+}
+
+/**
+ * Decode base64, line breaks and padding are skipped.
+ */
+QByteArray FromBase64(const QByteArray& base64)
+{
+	QByteArray data(Base64DecodedBound(base64.size()), Qt::Uninitialized);
+	data.truncate(Base64Decode(base64.constData(), base64.size(), data.data()));
+	return data;
+}
+}
@@ -0,0 +1,36 @@
+#ifndef BASE64_HPP
+#define BASE64_HPP
+
+#include <QByteArray>
+
+
+namespace Nya
+{
+enum Base64Kernel
+{
+	Base64Scalar,
+	Base64Sse41,
+	Base64Avx2
+};
+
+Base64Kernel GetBase64Kernel();
+void SetBase64Kernel(Base64Kernel kernel);
+
+/**
+ * Wrapped output has CRLF after every 76 chars, including the last line.
+ */
+inline int Base64EncodedSize(int len, bool isWrapped)
+{
+	int size = (len + 2) / 3 * 4;
+	return isWrapped ? size + (len + 56) / 57 * 2 : size;
+}
+inline int Base64DecodedBound(int len) { return len / 4 * 3 + len % 4 + 8; }
+
+int Base64Encode(const char* in, int len, char* out, bool isWrapped = false);
+int Base64Decode(const char* in, int len, char* out);
+
+QByteArray ToBase64(const QByteArray& data, bool isWrapped = false);
+QByteArray FromBase64(const QByteArray& base64);
+}
+
+#endif // BASE64_HPP
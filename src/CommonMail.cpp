@@ -1,6 +1,7 @@
 #include <QTextCodec>
 #include <QRegExp>
 
+#include "Base64.hpp"
 #include "CommonMail.hpp"
 
 
@@ -24,19 +25,23 @@ char GuessEncoding(const QString& s)
 
 /**
  * Create mime entity.
+ * With isUtf8 (SMTPUTF8) non-ASCII values are not encoded.
  */
-QByteArray CreateEntity(const QByteArray& key, const QString& value, const QByteArray& prefix)
+QByteArray CreateEntity(const QByteArray& key, const QString& value, const QByteArray& prefix, bool isUtf8)
 {
 	QByteArray data = "";
 	QByteArray line = key + ": ";
 	if (!prefix.isEmpty()) line += prefix;
 
-	switch (GuessEncoding(value))
+	char enc = GuessEncoding(value);
+	if (isUtf8 && !value.contains("=?")) enc = '8';
+	switch (enc)
 	{
 	case 'a':
+	case '8':
 	{
 		bool firstWord = true;
-		for (const QByteArray& word : value.toLatin1().split(' '))
+		for (const QByteArray& word : (enc == 'a' ? value.toLatin1() : value.toUtf8()).split(' '))
 		{
 			if (line.size() > 78) { data += line + "\r\n"; line.clear(); }
 
@@ -48,7 +53,7 @@ QByteArray CreateEntity(const QByteArray& key, const QString& value, const QByte
 	case 'b': // base64
 	{
 		// > 20% non-ASCII characters
-		QByteArray base64 = value.toUtf8().toBase64();
+		QByteArray base64 = ToBase64(value.toUtf8());
 
 		line += "=?utf-8?b?";
 		for (int i = 0; i < base64.size(); i += 4)
@@ -9,9 +9,17 @@
 
 namespace Nya
 {
+enum TransferFlag
+{
+	DotStuffing = 0x1, // DATA transfer, lines starting with '.' are doubled
+	BinaryMime = 0x2,  // BDAT transfer with BINARYMIME, attachments are not encoded
+	EightBit = 0x4,    // 8BITMIME, non-ASCII text is sent as raw UTF-8
+	Utf8Headers = 0x8  // SMTPUTF8, non-ASCII headers are sent as raw UTF-8
+};
+
 inline bool IsSpecialChar(char x) { return x < 32 || x > 126 || x == '=' || x == '?'; }
 char GuessEncoding(const QString& s);
-QByteArray CreateEntity(const QByteArray& key, const QString& value, const QByteArray& prefix = QByteArray());
+QByteArray CreateEntity(const QByteArray& key, const QString& value, const QByteArray& prefix = QByteArray(), bool isUtf8 = false);
 bool IsText(const QByteArray& contentType);
 }
 #endif // COMMONMAIL_HPP
@@ -0,0 +1,201 @@
+#include "AttachmentNya.hpp"
+#include "MailNya.hpp"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QThreadPool>
+
+#include "MailImporterNya.hpp"
+
+
+namespace Nya
+{
+/**
+ * Parses one batch on the pool.
+ */
+class ImportJob : public QRunnable
+{
+	MailImporter* importer;
+	s_p<MailImporter::Batch> batch;
+
+public:
+	ImportJob(MailImporter* importer, s_p<MailImporter::Batch> batch) : importer(importer), batch(batch) {}
+
+	void run()
+	{
+		importer->Parse(*batch);
+		QMutexLocker locker(&importer->mutex);
+		batch->isDone = true;
+		importer->batchDone.wakeAll();
+	}
+};
+
+/**
+ * A directory is read as a Maildir (cur and new, or the directory itself),
+ * anything else as an mbox file.
+ * The window defaults to twice the pool threads.
+ */
+MailImporter::MailImporter(const QString& path, int batchSize, int window, QThreadPool* pool, QObject* parent)
+	: QObject(parent)
+	, batchSize(qMax(batchSize, 1))
+	, pool(pool ? pool : QThreadPool::globalInstance())
+{
+	this->window = (window > 0) ? window : 2 * this->pool->maxThreadCount();
+
+	if (QFileInfo(path).isDir())
+	{
+		QDir dir(path);
+		QStringList subdirs;
+		if (dir.exists("cur")) subdirs << "cur";
+		if (dir.exists("new")) subdirs << "new";
+		if (subdirs.isEmpty()) subdirs << ".";
+		for (const QString& subdir : subdirs)
+		{
+			QDir files(dir.filePath(subdir));
+			for (const QString& name : files.entryList(QDir::Files, QDir::Name))
+			{
+				paths << files.filePath(name);
+			}
+		}
+	}
+	else
+	{
+		mbox = s_p<QFile>(new QFile(path));
+		if (!mbox->open(QIODevice::ReadOnly))
+		{
+			mboxError = QString("Cannot open %1: %2").arg(path).arg(mbox->errorString());
+			mbox.reset();
+		}
+	}
+}
+
+/**
+ * Waits for the batches still being parsed.
+ */
+MailImporter::~MailImporter()
+{
+	QMutexLocker locker(&mutex);
+	for (const s_p<Batch>& batch : inFlight)
+	{
+		while (!batch->isDone) batchDone.wait(&mutex);
+	}
+}
+
+bool MailImporter::AtEnd() const
+{
+	if (!inFlight.isEmpty() || !mboxError.isEmpty()) return false; // the error is still to be reported
+	return mbox ? mbox->atEnd() : pathPos == paths.size();
+}
+
+/**
+ * Next batch of mails in archive order, blocking until it is parsed.
+ * Empty at the end.
+ */
+QList<s_p<Mail>> MailImporter::NextBatch()
+{
+	if (!mboxError.isEmpty())
+	{
+		emit SignalError(mboxError);
+		mboxError.clear();
+		return QList<s_p<Mail>>();
+	}
+	while (inFlight.size() < window && ReadBatch()) {}
+	if (inFlight.isEmpty()) return QList<s_p<Mail>>();
+
+	s_p<Batch> batch = inFlight.takeFirst();
+	{
+		QMutexLocker locker(&mutex);
+		while (!batch->isDone) batchDone.wait(&mutex);
+	}
+
+	// keep the pool busy while the caller handles this batch
+	while (inFlight.size() < window && ReadBatch()) {}
+	return batch->mails;
+}
+
+/**
+ * Read the raw messages or paths of a batch and queue it.
+ */
+bool MailImporter::ReadBatch()
+{
+	s_p<Batch> batch(new Batch);
+	if (mbox)
+	{
+		while (batch->messages.size() < batchSize && !mbox->atEnd())
+		{
+			QByteArray message = ReadMboxMessage();
+			if (!message.isEmpty()) batch->messages.append(message);
+		}
+	}
+	else
+	{
+		batch->paths = paths.mid(pathPos, batchSize);
+		pathPos += batch->paths.size();
+	}
+	if (batch->messages.isEmpty() && batch->paths.isEmpty()) return false;
+
+	inFlight.append(batch);
+	pool->start(new ImportJob(this, batch));
+	return true;
+}
+
+/**
+ * Message up to the next "From " separator line, with CRLF line breaks.
+ * Quoted ">From " lines (mboxrd) lose one '>'.
+ */
+QByteArray MailImporter::ReadMboxMessage()
+{
+	QByteArray message;
+	while (!mbox->atEnd())
+	{
+		QByteArray line = mbox->readLine();
+		if (line.startsWith("From "))
+		{
+			if (message.isEmpty()) continue;
+			break;
+		}
+
+		int end = line.size();
+		if (end > 0 && line[end - 1] == '\n') --end;
+		if (end > 0 && line[end - 1] == '\r') --end;
+		int quotes = 0;
+		while (quotes < end && line[quotes] == '>') ++quotes;
+		int start = (quotes > 0 && qstrncmp(line.constData() + quotes, "From ", 5) == 0) ? 1 : 0;
+
+		message.append(line.constData() + start, end - start);
+		message.append("\r\n");
+	}
+	if (message.endsWith("\r\n\r\n")) message.chop(2); // blank line before the separator
+	return message;
+}
+
+/**
+ * Runs on the pool. Maildir files are read rather than mapped,
+ * so that imported mails do not hold a file descriptor each.
+ * The attachment devices are created here and handed to the importer's thread.
+ */
+void MailImporter::Parse(Batch& batch)
+{
+	for (const QByteArray& message : batch.messages)
+	{
+		batch.mails.append(s_p<Mail>(new Mail(message)));
+	}
+	for (const QString& path : batch.paths)
+	{
+		QFile file(path);
+		if (file.open(QIODevice::ReadOnly)) batch.mails.append(s_p<Mail>(new Mail(file.readAll())));
+	}
+	batch.messages.clear();
+
+	for (const s_p<Mail>& mail : batch.mails)
+	{
+		for (const s_p<Attachment>& attachment : mail->GetAttachments())
+		{
+			if (attachment->content) attachment->content->moveToThread(thread());
+		}
+	}
+}
+}
@@ -0,0 +1,69 @@
+#ifndef MAILIMPORTERNYA_H
+#define MAILIMPORTERNYA_H
+
+#include "CommonMail.hpp"
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QStringList>
+#include <QWaitCondition>
+
+
+class QFile;
+class QThreadPool;
+
+namespace Nya
+{
+class Mail;
+
+/**
+ * Bulk import of an mbox file or a Maildir directory.
+ * Messages are parsed in batches on a thread pool and returned in archive order.
+ * At most `window` batches are read ahead, so memory stays flat for any archive size.
+ * An mbox that cannot be opened is reported with SignalError by the first NextBatch(),
+ * unreadable Maildir files are skipped.
+ * The mails and their attachment devices belong to the thread of the importer.
+ */
+class MailImporter : public QObject
+{
+	Q_OBJECT
+
+	struct Batch
+	{
+		QList<QByteArray> messages; // mbox
+		QStringList paths; // Maildir
+		QList<s_p<Mail>> mails;
+		bool isDone = false;
+	};
+	friend class ImportJob;
+
+	s_p<QFile> mbox;
+	QString mboxError;
+	QStringList paths;
+	int pathPos = 0;
+	int batchSize;
+	int window;
+	QThreadPool* pool;
+	QList<s_p<Batch>> inFlight;
+	QMutex mutex;
+	QWaitCondition batchDone;
+
+public:
+	MailImporter(const QString& path, int batchSize = 256, int window = 0, QThreadPool* pool = 0, QObject* parent = 0);
+	~MailImporter();
+
+	bool AtEnd() const;
+	QList<s_p<Mail>> NextBatch();
+
+private:
+	bool ReadBatch();
+	QByteArray ReadMboxMessage();
+	void Parse(Batch& batch);
+
+signals:
+	void SignalError(const QString& message);
+};
+}
+
+#endif // MAILIMPORTERNYA_H
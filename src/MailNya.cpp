@@ -1,10 +1,14 @@
 #include "AttachmentNya.hpp"
+#include "Base64.hpp"
 #include "CommonMail.hpp"
+#include "MailStreamNya.hpp"
 #include "Rfc2822.hpp"
 
 #include <QDir>
+#include <QFile>
 #include <QTextCodec>
 #include <QUuid>
+#include <climits>
 
 #include "MailNya.hpp"
 
@@ -26,6 +30,51 @@ Mail::Mail(const QByteArray& rfc2822)
 Mail::~Mail()
 {}
 
+/**
+ * Load an .eml file by mapping it instead of reading it.
+ * Attachment bodies stay views into the mapping, which is kept as long as they are.
+ * Files that cannot be mapped are read. Returns null if the file cannot be opened.
+ */
+s_p<Mail> Mail::FromFile(const QString& filePath)
+{
+	s_p<QFile> file(new QFile(filePath));
+	if (!file->open(QIODevice::ReadOnly)) return nullptr;
+
+	qint64 size = file->size();
+	uchar* data = (size > 0 && size <= INT_MAX) ? file->map(0, size) : nullptr;
+	if (!data) return s_p<Mail>(new Mail(file->readAll()));
+
+	s_p<Mail> mail(new Mail(QString()));
+	Rfc2822 parser(mail.get(), file);
+	parser.Parse(QByteArray::fromRawData((const char*)data, int(size)));
+	return mail;
+}
+
+/**
+ * Same message apart from the Bcc recipients, which are only in the envelope.
+ * Attachments are the same objects, or the same files or in-memory content.
+ */
+bool Mail::IsSameContent(const Mail& other) const
+{
+	if (sender != other.sender || subject != other.subject || text != other.text ||
+		rcptTo != other.rcptTo || rcptCc != other.rcptCc || extraHeaders != other.extraHeaders ||
+		wordWrap != other.wordWrap || isKeepIndentation != other.isKeepIndentation ||
+		attachments.size() != other.attachments.size())
+	{
+		return false;
+	}
+	for (auto i = attachments.begin(); i != attachments.end(); ++i)
+	{
+		s_p<Attachment> a = i.value();
+		s_p<Attachment> b = other.attachments.value(i.key());
+		if (a == b) continue;
+		if (!b || a->contentType != b->contentType || a->extraHeaders != b->extraHeaders) return false;
+		QByteArray key = a->CacheKey();
+		if (key.isEmpty() || key != b->CacheKey()) return false;
+	}
+	return true;
+}
+
 /**
  * Get all recipients.
  */
@@ -44,6 +93,7 @@ void Mail::AddRecipient(const QString& recipient, RecipientType type)
 	if (type == R_BCC) rcptBcc.append(recipient);
 	else if (type == R_CC) rcptCc.append(recipient);
 	else rcptTo.append(recipient);
+	Invalidate();
 }
 
 /**
@@ -54,6 +104,7 @@ void Mail::RemoveRecipient(const QString& recipient)
 	rcptTo.removeAll(recipient);
 	rcptCc.removeAll(recipient);
 	rcptBcc.removeAll(recipient);
+	Invalidate();
 }
 
 /**
@@ -62,6 +113,7 @@ void Mail::RemoveRecipient(const QString& recipient)
 void Mail::AddExtraHeader(const QByteArray& key, const QByteArray& value)
 {
 	extraHeaders[key.toLower()] = value;
+	Invalidate();
 }
 
 /**
@@ -70,6 +122,7 @@ void Mail::AddExtraHeader(const QByteArray& key, const QByteArray& value)
 void Mail::RemoveExtraHeader(const QByteArray& key)
 {
 	extraHeaders.remove(key.toLower());
+	Invalidate();
 }
 
 /**
@@ -100,6 +153,7 @@ void Mail::AddAttachment(const QString& fileName, Attachment* pA)
 		}
 	}
 	attachments[newName] = a;
+	Invalidate();
 }
 
 /**
@@ -108,37 +162,176 @@ void Mail::AddAttachment(const QString& fileName, Attachment* pA)
 void Mail::RemoveAttachment(const QString& filename)
 {
 	attachments.remove(filename);
+	Invalidate();
 }
 
 /**
- * Convert to ASCII.
+ * Convert to ASCII, empty if an attachment could not be read.
+ * The result is kept until the mail is changed, changes made through
+ * the attachment objects themselves are not seen.
  */
 Mail::operator QByteArray() const
 {
+	if (!serialized.isEmpty()) return serialized;
+
+	// template and spooled wire data for flags 0 is dot-stuffed by the stream, once
+	MailStream stream(*this);
+	while (!stream.AtEnd()) serialized += stream.Read();
+	if (stream.IsFailed())
+	{
+		serialized.clear();
+		return QByteArray();
+	}
+	if (wireData.isEmpty())
+	{
+		wireData.append(serialized);
+		wireFlags = DotStuffing;
+	}
+	return serialized;
+}
+
+// RFC 5321/2045: 998 octets before CRLF, one kept for dot-stuffing
+static const int MaxLineOctets = 997;
+
+/**
+ * Append a line with CRLF, hard broken at MaxLineOctets on a UTF-8 char boundary.
+ */
+static void AppendLine(QByteArray& data, const QByteArray& line, bool isDotStuffing)
+{
+	int pos = 0;
+	do
+	{
+		int len = qMin(line.size() - pos, MaxLineOctets);
+		if (pos + len < line.size())
+		{
+			while (len > 1 && (line[pos + len] & 0xc0) == 0x80) --len;
+		}
+		if (isDotStuffing && len > 0 && line[pos] == '.') data += '.';
+		data.append(line.constData() + pos, len);
+		data += "\r\n";
+		pos += len;
+	}
+	while (pos < line.size());
+}
+
+/**
+ * Word wrap, line breaks become CRLF.
+ * UTF-8 text is wrapped by chars, not bytes, but no line goes over the octet limit:
+ * a word longer than that (e.g. CJK text without spaces) is hard broken.
+ */
+QByteArray Mail::WrapText(const QByteArray& ba, bool isUtf8, bool isDotStuffing) const
+{
+	int len = ba.size();
+	QByteArray data;
+	QByteArray line;
+	QByteArray word;
+	QByteArray spaces;
+	QByteArray startSpaces;
+	int lineChars = 0;
+	int wordChars = 0;
+	for (int i = 0; i <= len; ++i)
+	{
+		char ignoredChar = 0;
+		if (i != len)
+		{
+			ignoredChar = (ba[i] == '\n') ? '\r' : (ba[i] == '\r') ? '\n' : 0;
+		}
+
+		if (!(ignoredChar || (i == len) || (ba[i] == ' ') || (ba[i] == '\t')))
+		{
+			// the char is part of word
+			if (word.isEmpty())
+			{
+				// start of new word / end of spaces
+				if (line.isEmpty()) startSpaces = spaces;
+			}
+			word += ba[i];
+			if (!isUtf8 || (ba[i] & 0xc0) != 0x80) ++wordChars;
+			continue;
+		}
+
+		// space char, so end of word or continuous spaces
+		if (!word.isEmpty())
+		{
+			if (lineChars + spaces.length() + wordChars > wordWrap)
+			{
+				// have to wrap word to next line, unless it is the first one
+				if (!line.isEmpty()) AppendLine(data, line, isDotStuffing);
+				if (isKeepIndentation) line = startSpaces + word;
+				else line = word;
+				lineChars = line.length() - word.length() + wordChars;
+			}
+			else // no wrap required
+			{
+				line += spaces + word;
+				lineChars += spaces.length() + wordChars;
+			}
+			word.clear();
+			wordChars = 0;
+			spaces.clear();
+		}
+
+		if (ignoredChar || i == len)
+		{
+			// trailing `spaces` are ignored here
+			AppendLine(data, line, isDotStuffing);
+			line.clear();
+			lineChars = 0;
+			startSpaces.clear();
+			spaces.clear();
+		}
+		else spaces += ba[i];
+	}
+	return data;
+}
+
+/**
+ * Headers and text part, everything before the attachments.
+ */
+QByteArray Mail::TextData(int flags) const
+{
+	char enc = TextEncoding(flags);
+	return TextHeader(enc, flags) + EncodeText(text, enc, flags & DotStuffing);
+}
+
+/**
+ * Transfer encoding of the text, raw UTF-8 when the server takes 8bit.
+ */
+char Mail::TextEncoding(int flags) const
+{
+	QByteArray cte = extraHeaders["Content-Transfer-Encoding"].toLower();
+	char enc = (cte == "base64") ? 'b' : (cte == "quoted-printable") ? 'q' : 0;
+	if (!enc) enc = GuessEncoding(text);
+	if (enc != 'a' && cte.isEmpty() && (flags & EightBit)) enc = '8';
+	return enc;
+}
+
+/**
+ * Headers and the lead-in of the text part for encoding `enc`.
+ */
+QByteArray Mail::TextHeader(char enc, int flags) const
+{
+	bool isUtf8 = flags & Utf8Headers;
+
 	// headers
 	QByteArray data;
 	if (!sender.isEmpty() && !extraHeaders.contains("From"))
 	{
-		data += CreateEntity("From", sender);
+		data += CreateEntity("From", sender, QByteArray(), isUtf8);
 	}
 	if (!rcptTo.isEmpty())
 	{
-		data += CreateEntity("To", rcptTo.join(", "));
+		data += CreateEntity("To", rcptTo.join(", "), QByteArray(), isUtf8);
 	}
 	if (!rcptCc.isEmpty())
 	{
-		data += CreateEntity("Cc", rcptCc.join(", "));
+		data += CreateEntity("Cc", rcptCc.join(", "), QByteArray(), isUtf8);
 	}
 	if (!subject.isEmpty())
 	{
-		data += CreateEntity("Subject", subject);
+		data += CreateEntity("Subject", subject, QByteArray(), isUtf8);
 	}
 
-	// encoding
-	QByteArray cte = extraHeaders["Content-Transfer-Encoding"].toLower();
-	char enc = (cte == "base64") ? 'b' : (cte == "quoted-printable") ? 'q' : 0;
-	if (!enc) enc = GuessEncoding(text);
-
 	if (enc != 'a' && !extraHeaders.contains("MIME-Version") && !attachments.count())
 	{
 		data += "MIME-Version: 1.0\r\n";
@@ -161,6 +354,12 @@ Mail::operator QByteArray() const
 	{
 		data += "Content-Transfer-Encoding: quoted-printable\r\n";
 	}
+	else if (enc == '8')
+	{
+		if (!extraHeaders.contains("content-type"))
+			data += "Content-Type: text/plain; charset=UTF-8\r\n";
+		data += "Content-Transfer-Encoding: 8bit\r\n";
+	}
 
 	for (auto i = extraHeaders.begin(); i != extraHeaders.end(); ++i)
 	{
@@ -170,7 +369,7 @@ Mail::operator QByteArray() const
 			// Since we're in multipart mode, we'll be outputting this later
 			continue;
 		}
-		data += CreateEntity(key, i.value());
+		data += CreateEntity(key, i.value(), QByteArray(), isUtf8);
 	}
 	data += "\r\n";
 
@@ -200,76 +399,32 @@ Mail::operator QByteArray() const
 		{
 			data += "Content-Transfer-Encoding: quoted-printable\r\n";
 		}
+		else if (enc == '8')
+		{
+			data += "Content-Transfer-Encoding: 8bit\r\n";
+		}
 		data += "\r\n";
 	}
+	return data;
+}
 
+/**
+ * Text body in encoding `enc`.
+ */
+QByteArray Mail::EncodeText(const QString& text, char enc, bool isDotStuffing) const
+{
+	QByteArray data;
 	if (enc == 'a')
 	{
-		QByteArray ba = text.toLatin1();
-		int len = ba.size();
-		QByteArray line;
-		QByteArray word;
-		QByteArray spaces;
-		QByteArray startSpaces;
-		for (int i = 0; i <= len; ++i)
-		{
-			char ignoredChar = 0;
-			if (i != len)
-			{
-				ignoredChar = (ba[i] == '\n') ? '\r' : (ba[i] == '\r') ? '\n' : 0;
-			}
-
-			if (!(ignoredChar || (i == len) || (ba[i] == ' ') || (ba[i] == '\t')))
-			{
-				// the char is part of word
-				if (word.isEmpty())
-				{
-					// start of new word / end of spaces
-					if (line.isEmpty()) startSpaces = spaces;
-				}
-				word += ba[i];
-				continue;
-			}
-
-			// space char, so end of word or continuous spaces
-			if (!word.isEmpty())
-			{
-				if (line.length() + spaces.length() + word.length() > wordWrap)
-				{
-					// have to wrap word to next line
-					if(line[0] == '.')
-						data += ".";
-					data += line + "\r\n";
-					if (isKeepIndentation) line = startSpaces + word;
-					else line = word;
-				}
-				else // no wrap required
-				{
-					line += spaces + word;
-				}
-				word.clear();
-				spaces.clear();
-			}
-
-			if (ignoredChar || i == len)
-			{
-				// trailing `spaces` are ignored here
-				if(line[0] == '.') data += ".";
-				data += line + "\r\n";
-				line.clear();
-				startSpaces.clear();
-				spaces.clear();
-			}
-			else spaces += ba[i];
-		}
+		data += WrapText(text.toLatin1(), false, isDotStuffing);
+	}
+	else if (enc == '8')
+	{
+		data += WrapText(text.toUtf8(), true, isDotStuffing);
 	}
 	else if (enc == 'b')
 	{
-		QByteArray ba = text.toUtf8().toBase64();
-		for (int i = 0; i < ba.size(); i += 78)
-		{
-			data += ba.mid(i, 78) + "\r\n";
-		}
+		data += ToBase64(text.toUtf8(), true);
 	}
 	else if (enc == 'q')
 	{
@@ -279,7 +434,7 @@ Mail::operator QByteArray() const
 		{
 			if(ba[i] == '\n' || ba[i] == '\r')
 			{
-				if(line[0] == '.') data += ".";
+				if(isDotStuffing && line[0] == '.') data += ".";
 
 				data += line + "\r\n";
 				line = "";
@@ -303,22 +458,11 @@ Mail::operator QByteArray() const
 		}
 		if (!line.isEmpty())
 		{
-			if(line[0] == '.') data += ".";
+			if(isDotStuffing && line[0] == '.') data += ".";
 			data += line + "\r\n";
 		}
 	}
 
-	if (attachments.count())
-	{
-		for (auto i = attachments.begin(); i != attachments.end(); ++i)
-		{
-			QString filename = i.key();
-			data += "--" + boundary + "\r\n";
-			data += CreateEntity("Content-Disposition", QDir(filename).dirName(), "attachment; filename=");
-			data += i.value()->MimeData();
-		}
-		data += "--" + boundary + "--\r\n";
-	}
 	return data;
 }
 
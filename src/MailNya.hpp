@@ -19,6 +19,9 @@ class Attachment;
 class Mail
 {
 	friend class Rfc2822;
+	friend class MailStream;
+	friend class MailTemplate;
+	friend class MailSpool;
 
 	QString sender, subject, text;
 	QStringList rcptTo, rcptCc, rcptBcc;
@@ -27,21 +30,27 @@ class Mail
 	int wordWrap = 78;
 	bool isKeepIndentation = false;
 	mutable QByteArray boundary;
+	mutable QList<QByteArray> wireData; // last serialized or rendered by a template, for wireFlags
+	mutable int wireFlags = -1;
+	mutable QByteArray serialized; // operator QByteArray, whatever the flags of wireData
 
 public:
 	Mail(const QString& sender, const QString& subject = "", const QString& text = "");
 	Mail(const QByteArray& rfc2822);
 	virtual ~Mail();
 
+	static s_p<Mail> FromFile(const QString& filePath);
+
 	QString GetSender() const { return sender; }
 	QString GetSubject() const { return subject; }
 	QStringList GetRecipients(RecipientType type = R_TO) const;
 	QHash<QByteArray, QByteArray> ExtraHeaders() const { return extraHeaders; }
 	QHash<QString, s_p<Attachment>> GetAttachments() const { return attachments; }
+	bool IsSameContent(const Mail& other) const;
 
-	void SetText(const QString& text) { this->text = text; }
-	void SetWordWrapLimit(int wordWrap) { this->wordWrap = wordWrap; }
-	void SetKeepIndentation(bool isOn) { isKeepIndentation = isOn; }
+	void SetText(const QString& text) { this->text = text; Invalidate(); }
+	void SetWordWrapLimit(int wordWrap) { this->wordWrap = wordWrap; Invalidate(); }
+	void SetKeepIndentation(bool isOn) { isKeepIndentation = isOn; Invalidate(); }
 
 	void AddRecipient(const QString& recipient, RecipientType type = R_TO);
 	void RemoveRecipient(const QString& recipient);
@@ -52,6 +61,14 @@ public:
 	void RemoveAttachment(const QString& filename);
 
 	operator QByteArray() const; // to rfc2822
+
+private:
+	void Invalidate() { wireData.clear(); serialized.clear(); }
+	QByteArray TextData(int flags) const;
+	char TextEncoding(int flags) const;
+	QByteArray TextHeader(char enc, int flags) const;
+	QByteArray EncodeText(const QString& text, char enc, bool isDotStuffing) const;
+	QByteArray WrapText(const QByteArray& ba, bool isUtf8, bool isDotStuffing) const;
 };
 
 }
@@ -0,0 +1,268 @@
+#include "Base64.hpp"
+#include "CommonMail.hpp"
+#include "Rfc2822.hpp"
+
+#include <QIODevice>
+#include <cstring>
+
+#include "MailParserNya.hpp"
+
+
+namespace Nya
+{
+static const int MaxLineSize = 1000; // longer partial lines are data, not delimiters
+static const int MaxMimeDepth = 16;
+
+static inline bool IsWsp(char c) { return c == ' ' || c == '\t'; }
+static inline bool IsBase64Char(char c)
+{
+	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '+' || c == '/';
+}
+
+/**
+ * Quoted-printable line, without its line break if isFullLine.
+ * Returns false for a soft line break.
+ */
+static bool DecodeQpLine(const QByteArray& line, bool isFullLine, QByteArray& out)
+{
+	const char* in = line.constData();
+	int len = line.size();
+	if (isFullLine) while (len > 0 && IsWsp(in[len - 1])) --len;
+	bool isSoft = isFullLine && len > 0 && in[len - 1] == '=';
+	if (isSoft) --len;
+
+	for (int i = 0; i < len; ++i)
+	{
+		if (in[i] != '=')
+		{
+			out += in[i];
+		}
+		else if (i + 2 < len)
+		{
+			out += QByteArray::fromHex(QByteArray::fromRawData(in + i + 1, 2));
+			i += 2;
+		}
+	}
+	return !isSoft;
+}
+
+MailParser::MailParser(QObject* parent)
+	: QObject(parent)
+{}
+
+/**
+ * Parse the complete lines of the chunk, the rest is kept for the next one.
+ */
+void MailParser::Feed(const QByteArray& chunk)
+{
+	if (partCount == 0) StartPart(-1);
+	buffer += chunk;
+
+	const char* data = buffer.constData();
+	int size = buffer.size();
+	int pos = 0;
+	while (pos < size)
+	{
+		const char* lf = (const char*)memchr(data + pos, '\n', size - pos);
+		if (!lf) break;
+		int next = int(lf - data) + 1;
+		int end = (next - 1 > pos && data[next - 2] == '\r') ? next - 2 : next - 1;
+		OnLine(QByteArray::fromRawData(data + pos, end - pos), QByteArray::fromRawData(data + end, next - end));
+		pos = next;
+	}
+
+	// a long partial body line cannot be a delimiter, pass it on now
+	if (!isHeaders && size - pos > MaxLineSize && !frames.last().isMultipart)
+	{
+		int cut = size;
+		if (frames.last().cte == "quoted-printable")
+		{
+			for (int k = 2; k > 0; --k)
+			{
+				if (data[size - k] == '=')
+				{
+					cut = size - k;
+					break;
+				}
+			}
+		}
+		OnData(QByteArray::fromRawData(data + pos, cut - pos), QByteArray());
+		isMidLine = true;
+		pos = cut;
+	}
+	buffer.remove(0, pos);
+}
+
+/**
+ * End of the message: the last line and all open parts are finished.
+ * The parser can be fed the next message afterwards.
+ */
+void MailParser::Finish()
+{
+	if (partCount == 0) StartPart(-1);
+	if (!buffer.isEmpty())
+	{
+		OnLine(buffer, QByteArray());
+		buffer.clear();
+	}
+	if (isHeaders) EndHeaders();
+	while (!frames.isEmpty()) EndPart();
+
+	partCount = 0;
+	isMidLine = false;
+}
+
+/**
+ * Line without its line break.
+ */
+void MailParser::OnLine(const QByteArray& line, const QByteArray& lineBreak)
+{
+	if (isMidLine)
+	{
+		isMidLine = false;
+		OnData(line, lineBreak);
+		return;
+	}
+	if (line.startsWith("--") && OnDelimiter(line)) return;
+
+	if (isHeaders)
+	{
+		headerBuffer += line;
+		headerBuffer += "\r\n";
+		if (line.isEmpty()) EndHeaders();
+		return;
+	}
+	OnData(line, lineBreak);
+}
+
+/**
+ * Delimiter of any open multipart, the innermost first.
+ * The parts inside the multipart are ended.
+ */
+bool MailParser::OnDelimiter(const QByteArray& line)
+{
+	for (int i = frames.size() - 1; i >= 0; --i)
+	{
+		QByteArray& delimiter = frames[i].delimiter;
+		if (delimiter.isEmpty() || !line.startsWith(delimiter)) continue;
+
+		int pos = delimiter.size();
+		bool isClose = line.size() >= pos + 2 && line[pos] == '-' && line[pos + 1] == '-';
+		if (isClose) pos += 2;
+		while (pos < line.size() && IsWsp(line[pos])) ++pos;
+		if (pos != line.size()) continue;
+
+		if (isHeaders) EndHeaders();
+		heldBreak.clear(); // the line break before a delimiter belongs to it
+		while (frames.size() > i + 1) EndPart();
+		if (isClose) delimiter.clear(); // the epilogue follows
+		else StartPart(frames[i].part);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Body line of the current part, decoded and written.
+ * Its line break is held back until the next line shows it is not a delimiter.
+ */
+void MailParser::OnData(const QByteArray& line, const QByteArray& lineBreak)
+{
+	const Frame& frame = frames.last();
+	if (frame.isMultipart) return; // preamble and epilogue
+
+	QByteArray data = heldBreak;
+	heldBreak.clear();
+	if (frame.cte == "base64")
+	{
+		for (char c : line)
+		{
+			if (IsBase64Char(c)) pending += c;
+		}
+		int len = pending.size() / 4 * 4;
+		if (len > 0)
+		{
+			int pos = data.size();
+			data.resize(pos + Base64DecodedBound(len));
+			data.resize(pos + Base64Decode(pending.constData(), len, data.data() + pos));
+			pending.remove(0, len);
+		}
+	}
+	else if (frame.cte == "quoted-printable")
+	{
+		if (DecodeQpLine(line, !lineBreak.isEmpty(), data) && !lineBreak.isEmpty()) heldBreak = "\n";
+	}
+	else // 7bit, 8bit or binary
+	{
+		data += line;
+		if (!lineBreak.isEmpty()) heldBreak = frame.isText ? QByteArray("\n") : lineBreak;
+	}
+	Write(frame.part, data);
+}
+
+void MailParser::StartPart(int parent)
+{
+	Frame frame;
+	frame.part = partCount++;
+	frames.append(frame);
+	isHeaders = true;
+	device = 0;
+	emit SignalPartStart(frame.part, parent);
+}
+
+/**
+ * Headers of the current part, a multipart gets its delimiter.
+ */
+void MailParser::EndHeaders()
+{
+	QHash<QByteArray, QByteArray> headers;
+	Rfc2822::ParseHeaders(headerBuffer, 0, headers);
+	headerBuffer.clear();
+	isHeaders = false;
+
+	Frame& frame = frames.last();
+	QByteArray contentType = headers.value("content-type");
+	if (frames.size() <= MaxMimeDepth && qstrnicmp(contentType.constData(), "multipart/", 10) == 0)
+	{
+		QByteArray boundary = Rfc2822::HeaderParam(contentType, "boundary");
+		frame.isMultipart = !boundary.isEmpty();
+		if (frame.isMultipart) frame.delimiter = "--" + boundary;
+	}
+	frame.cte = headers.value("content-transfer-encoding").toLower();
+	frame.isText = IsText(contentType);
+	emit SignalHeaders(frame.part, headers);
+}
+
+/**
+ * Flush the decoder of the innermost part and end it.
+ */
+void MailParser::EndPart()
+{
+	Frame frame = frames.takeLast();
+	if (!frame.isMultipart)
+	{
+		QByteArray data = heldBreak;
+		if (!pending.isEmpty())
+		{
+			int pos = data.size();
+			data.resize(pos + Base64DecodedBound(pending.size()));
+			data.resize(pos + Base64Decode(pending.constData(), pending.size(), data.data() + pos));
+		}
+		Write(frame.part, data);
+	}
+	pending.clear();
+	heldBreak.clear();
+	device = 0;
+	emit SignalPartEnd(frame.part);
+}
+
+/**
+ * Decoded data to the device, or to the listeners if there is none.
+ */
+void MailParser::Write(int part, const QByteArray& data)
+{
+	if (data.isEmpty()) return;
+	if (device) device->write(data);
+	else emit SignalPartData(part, data);
+}
+}
@@ -0,0 +1,69 @@
+#ifndef MAILPARSERNYA_H
+#define MAILPARSERNYA_H
+
+#include "CommonMail.hpp"
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QObject>
+
+
+class QIODevice;
+
+namespace Nya
+{
+/**
+ * Rfc2822 push parser, the message is fed in chunks of any size.
+ * Parts are numbered in document order, the message itself is part 0.
+ * The body of a non-multipart part is decoded and written to the device given
+ * to SetDevice() from a SignalHeaders handler, or emitted with SignalPartData.
+ * Memory use depends on the chunk size and the header size, not on the message size.
+ */
+class MailParser : public QObject
+{
+	Q_OBJECT
+
+	struct Frame
+	{
+		int part;
+		QByteArray delimiter; // of a multipart, until its close delimiter
+		QByteArray cte;
+		bool isMultipart = false;
+		bool isText = false;
+	};
+
+	QByteArray buffer;
+	QByteArray headerBuffer;
+	QByteArray pending; // base64 chars short of a quad
+	QByteArray heldBreak; // decoded line break, dropped if the next line is a delimiter
+	QList<Frame> frames;
+	QIODevice* device = 0;
+	int partCount = 0;
+	bool isHeaders = true;
+	bool isMidLine = false;
+
+public:
+	MailParser(QObject* parent = 0);
+
+	void Feed(const QByteArray& chunk);
+	void Finish();
+	void SetDevice(QIODevice* device) { this->device = device; }
+
+private:
+	void OnLine(const QByteArray& line, const QByteArray& lineBreak);
+	bool OnDelimiter(const QByteArray& line);
+	void OnData(const QByteArray& line, const QByteArray& lineBreak);
+	void StartPart(int parent);
+	void EndHeaders();
+	void EndPart();
+	void Write(int part, const QByteArray& data);
+
+signals:
+	void SignalPartStart(int part, int parent);
+	void SignalHeaders(int part, const QHash<QByteArray, QByteArray>& headers);
+	void SignalPartData(int part, const QByteArray& data);
+	void SignalPartEnd(int part);
+};
+}
+
+#endif // MAILPARSERNYA_H
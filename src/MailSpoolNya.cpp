@@ -0,0 +1,385 @@
+#include "MailNya.hpp"
+#include "MailStreamNya.hpp"
+
+#include <QDir>
+#include <QSaveFile>
+#include <QSet>
+#include <QThread>
+#include <climits>
+#include <cstring>
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "MailSpoolNya.hpp"
+
+
+namespace Nya
+{
+/**
+ * Segment record: header, envelope (sender and recipients, one per line),
+ * wire data, then the Adler-32 of the envelope, the data and the header, in that order
+ * (the data size in the header is only known once the data is written).
+ */
+struct SpoolRecord
+{
+	quint32 magic;
+	quint32 envelopeSize;
+	quint64 id;
+	qint64 dataSize;
+};
+
+static const quint32 SpoolMagic = 0x4c4f5053; // "SPOL"
+static const qint64 MaxDirtyBytes = 16 * 1024 * 1024;
+
+static quint32 Adler32(quint32 adler, const char* data, qint64 len)
+{
+	quint32 a = adler & 0xffff, b = adler >> 16;
+	while (len > 0)
+	{
+		int n = int(qMin<qint64>(len, 5552)); // no overflow before the modulo
+		len -= n;
+		while (n--)
+		{
+			a += uchar(*data++);
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+static void SyncFile(QFile& file)
+{
+#if defined(Q_OS_WIN)
+	_commit(file.handle());
+#elif defined(Q_OS_LINUX)
+	fdatasync(file.handle());
+#else
+	fsync(file.handle());
+#endif
+}
+
+static QByteArray Envelope(const Mail& mail)
+{
+	QByteArray envelope = mail.GetSender().toUtf8() + '\n';
+	QStringList recipients = mail.GetRecipients(R_TO) + mail.GetRecipients(R_CC) + mail.GetRecipients(R_BCC);
+	for (const QString& recipient : recipients) envelope += recipient.toUtf8() + '\n';
+	return envelope;
+}
+
+/**
+ * Mail holding only the envelope, its wire data stays in the spool.
+ */
+static s_p<Mail> EnvelopeMail(const QByteArray& envelope)
+{
+	QList<QByteArray> lines = envelope.split('\n');
+	s_p<Mail> mail(new Mail(QString::fromUtf8(lines.value(0))));
+	for (int i = 1; i < lines.size(); ++i)
+	{
+		if (!lines[i].isEmpty()) mail->AddRecipient(QString::fromUtf8(lines[i]));
+	}
+	return mail;
+}
+
+MailSpool::MailSpool(const QString& path, QObject* parent)
+	: QObject(parent)
+	, path(path)
+	, commitTimer(this) // moves with the spool
+{
+	commitTimer.setSingleShot(true);
+	commitTimer.setInterval(10);
+	connect(&commitTimer, &QTimer::timeout, this, &MailSpool::Commit);
+}
+
+MailSpool::~MailSpool()
+{
+	Commit();
+}
+
+/**
+ * Creates the directory or recovers the mails left in it.
+ * Segments with nothing left to send are removed, a torn record at the end of a segment
+ * (a crash in the middle of a write) is cut off. Appends go to a new segment.
+ */
+bool MailSpool::Open()
+{
+	QDir dir(path);
+	if (!dir.mkpath(".")) return false;
+
+	QSet<quint64> done;
+	doneLog.setFileName(dir.filePath("done.log"));
+	if (doneLog.open(QIODevice::ReadOnly))
+	{
+		QByteArray ids = doneLog.readAll();
+		for (int i = 0; i + 8 <= ids.size(); i += 8)
+		{
+			quint64 id;
+			memcpy(&id, ids.constData() + i, 8);
+			done.insert(id);
+		}
+		doneLog.close();
+	}
+
+	QList<int> numbers;
+	for (const QString& name : dir.entryList(QStringList() << "*.seg", QDir::Files, QDir::Name))
+	{
+		numbers << name.section('.', 0, 0).toInt();
+	}
+	QList<quint64> kept; // done ids of the segments still there
+	for (int number : numbers)
+	{
+		s_p<QFile> file(new QFile(SegmentPath(number)));
+		if (!file->open(QIODevice::ReadWrite)) return false;
+
+		qint64 size = file->size();
+		uchar* data = size ? file->map(0, size) : nullptr;
+		qint64 pos = 0;
+		int live = 0;
+		while (data && pos + qint64(sizeof(SpoolRecord)) <= size)
+		{
+			SpoolRecord record;
+			memcpy(&record, data + pos, sizeof(record));
+			qint64 end = pos + sizeof(record) + record.envelopeSize + record.dataSize + 4;
+			if (record.magic != SpoolMagic || record.dataSize < 0 || end > size) break;
+			quint32 checksum;
+			memcpy(&checksum, data + end - 4, 4);
+			quint32 expected = Adler32(1, (const char*)data + pos + sizeof(record), end - 4 - pos - sizeof(record));
+			if (Adler32(expected, (const char*)&record, sizeof(record)) != checksum) break;
+
+			nextId = qMax(nextId, record.id + 1);
+			if (done.contains(record.id))
+			{
+				kept << record.id;
+			}
+			else
+			{
+				const char* envelope = (const char*)data + pos + sizeof(record);
+				s_p<Mail> mail = EnvelopeMail(QByteArray(envelope, record.envelopeSize));
+				Entry entry;
+				entry.id = record.id;
+				entry.segment = number;
+				entry.offset = pos + sizeof(record) + record.envelopeSize;
+				entry.size = record.dataSize;
+				entries.insert(mail.get(), entry);
+				recovered << mail;
+				live++;
+			}
+			pos = end;
+		}
+		if (data) file->unmap(data);
+		if (live == 0)
+		{
+			file->remove();
+			continue;
+		}
+		if (pos < size) file->resize(pos);
+		segments[number] = file;
+		liveCounts[number] = live;
+	}
+
+	QSaveFile log(doneLog.fileName());
+	if (!log.open(QIODevice::WriteOnly)) return false;
+	for (quint64 id : kept) log.write((const char*)&id, 8);
+	if (!log.commit()) return false;
+	if (!doneLog.open(QIODevice::WriteOnly | QIODevice::Append)) return false;
+
+	return OpenSegment(numbers.isEmpty() ? 1 : numbers.last() + 1);
+}
+
+/**
+ * Mails recovered by Open(), returned once.
+ */
+QList<s_p<Mail>> MailSpool::TakeRecovered()
+{
+	QList<s_p<Mail>> result = recovered;
+	recovered.clear();
+	return result;
+}
+
+/**
+ * Writes the mail and returns its spooled copy, with the same envelope and no content.
+ * Null when the spool is not open or the write failed.
+ */
+s_p<Mail> MailSpool::Append(const Mail& mail)
+{
+	if (active == -1) return nullptr;
+
+	QByteArray envelope = Envelope(mail);
+	SpoolRecord record = {SpoolMagic, quint32(envelope.size()), nextId, 0};
+	quint32 checksum = Adler32(1, envelope.constData(), envelope.size());
+
+	// the data is streamed chunk by chunk, the size is patched into the header after it
+	QFile& file = *segments[active];
+	qint64 pos = file.pos();
+	bool isOk = file.write((const char*)&record, sizeof(record)) == qint64(sizeof(record)) &&
+				file.write(envelope) == envelope.size();
+	MailStream stream(mail, 0);
+	while (isOk && !stream.AtEnd())
+	{
+		QByteArray chunk = stream.Read();
+		checksum = Adler32(checksum, chunk.constData(), chunk.size());
+		record.dataSize += chunk.size();
+		isOk = file.write(chunk) == chunk.size() && !stream.IsFailed() && record.dataSize <= INT_MAX;
+	}
+	qint64 end = pos + sizeof(record) + envelope.size() + record.dataSize;
+	checksum = Adler32(checksum, (const char*)&record, sizeof(record));
+	isOk = isOk && file.seek(pos) && file.write((const char*)&record, sizeof(record)) == qint64(sizeof(record)) &&
+		   file.seek(end) && file.write((const char*)&checksum, 4) == 4;
+	if (!isOk)
+	{
+		file.resize(pos);
+		file.seek(pos);
+		return nullptr;
+	}
+
+	s_p<Mail> spooled = EnvelopeMail(envelope);
+	Entry entry;
+	entry.id = nextId++;
+	entry.segment = active;
+	entry.offset = pos + sizeof(record) + envelope.size();
+	entry.size = record.dataSize;
+	entries.insert(spooled.get(), entry);
+	liveCounts[active]++;
+
+	isDirty = true;
+	dirtyBytes += file.pos() - pos;
+	if (dirtyBytes >= MaxDirtyBytes) Commit();
+	else StartCommitTimer();
+	if (file.pos() >= segmentSize)
+	{
+		Commit();
+		OpenSegment(active + 1);
+	}
+	return spooled;
+}
+
+/**
+ * Maps the wire data of a spooled mail for sending, or reads it if it cannot be mapped.
+ * Returns false if it could not be read, the mail must not be sent then.
+ */
+bool MailSpool::Load(const Mail& mail)
+{
+	auto i = entries.find(&mail);
+	if (i == entries.end() || !mail.wireData.isEmpty()) return true;
+
+	QFile& file = *segments[i->segment];
+	if (i->segment == active) file.flush();
+	i->map = i->size ? file.map(i->offset, i->size) : nullptr;
+	QByteArray data;
+	if (i->map)
+	{
+		data = QByteArray::fromRawData((const char*)i->map, int(i->size));
+	}
+	else if (i->size)
+	{
+		QFile reader(file.fileName());
+		if (!reader.open(QIODevice::ReadOnly) || !reader.seek(i->offset)) return false;
+		data = reader.read(i->size);
+		if (data.size() != i->size) return false;
+	}
+	mail.wireData = QList<QByteArray>() << data;
+	mail.wireFlags = 0;
+	return true;
+}
+
+/**
+ * The mail is sent or given up, it will not be recovered after the next commit.
+ */
+void MailSpool::Done(const Mail& mail)
+{
+	auto i = entries.find(&mail);
+	if (i == entries.end()) return;
+
+	Unmap(mail, *i);
+	doneLog.write((const char*)&i->id, 8);
+	int segment = i->segment;
+	entries.erase(i);
+	isDirty = true;
+	StartCommitTimer();
+	if (--liveCounts[segment] == 0 && segment != active) Release(segment);
+}
+
+/**
+ * The mail failed for now, it is forgotten until the next Open() recovers it.
+ */
+void MailSpool::Defer(const Mail& mail)
+{
+	auto i = entries.find(&mail);
+	if (i == entries.end()) return;
+
+	Unmap(mail, *i);
+	entries.erase(i); // its segment stays live
+}
+
+/**
+ * Makes everything appended or done so far durable, with one sync per file.
+ */
+void MailSpool::Commit()
+{
+	if (!isDirty) return;
+	if (QThread::currentThread() == thread()) commitTimer.stop(); // otherwise it finds nothing to commit
+	if (active != -1)
+	{
+		QFile& file = *segments[active];
+		file.flush();
+		SyncFile(file);
+	}
+	doneLog.flush();
+	SyncFile(doneLog);
+	dirtyBytes = 0;
+	isDirty = false;
+}
+
+bool MailSpool::OpenSegment(int number)
+{
+	int previous = active;
+	s_p<QFile> file(new QFile(SegmentPath(number)));
+	if (!file->open(QIODevice::ReadWrite | QIODevice::Truncate))
+	{
+		active = -1;
+		return false;
+	}
+	segments[number] = file;
+	liveCounts[number] = 0;
+	active = number;
+	if (previous != -1 && liveCounts.value(previous) == 0) Release(previous);
+	return true;
+}
+
+QString MailSpool::SegmentPath(int number) const
+{
+	return QDir(path).filePath(QString("%1.seg").arg(number, 8, 10, QChar('0')));
+}
+
+/**
+ * Appends may come from the thread of the caller of Smtp::Send, the timer starts in the spool's own.
+ */
+void MailSpool::StartCommitTimer()
+{
+	if (QThread::currentThread() != thread()) QMetaObject::invokeMethod(this, "StartCommitTimer", Qt::QueuedConnection);
+	else if (!commitTimer.isActive()) commitTimer.start();
+}
+
+void MailSpool::Unmap(const Mail& mail, Entry& entry)
+{
+	mail.wireData.clear();
+	mail.wireFlags = -1;
+	mail.serialized.clear();
+	if (entry.map) segments[entry.segment]->unmap(entry.map);
+	entry.map = nullptr;
+}
+
+/**
+ * Removes a segment with nothing left to send.
+ */
+void MailSpool::Release(int segment)
+{
+	s_p<QFile> file = segments.take(segment);
+	if (file) file->remove();
+	liveCounts.remove(segment);
+}
+}
@@ -0,0 +1,80 @@
+#ifndef MAILSPOOLNYA_H
+#define MAILSPOOLNYA_H
+
+#include "CommonMail.hpp"
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QTimer>
+
+
+namespace Nya
+{
+class Mail;
+
+/**
+ * Crash-safe on-disk queue of outbound mail, see Smtp::SetSpool.
+ * Mails are written once, in wire form for flags 0, to append-only segment files,
+ * and the queue only keeps their envelopes in memory. The body is mapped from the
+ * segment when the mail is sent and unmapped when it is done.
+ * Writes are made durable by group commit: one fsync for all the mails appended or done
+ * within the commit interval. Unfinished mails are recovered by Open(), so delivery
+ * is at least once, and mails that failed temporarily are sent again after Open().
+ * Smtp::SetSpool moves it to the thread of its Smtp, use it from there.
+ */
+class MailSpool : public QObject
+{
+	Q_OBJECT
+
+	struct Entry
+	{
+		quint64 id;
+		int segment;
+		qint64 offset; // of the wire data
+		qint64 size;
+		uchar* map = nullptr;
+	};
+
+	QString path;
+	QHash<int, s_p<QFile>> segments;
+	QHash<int, int> liveCounts;
+	QHash<const Mail*, Entry> entries;
+	QList<s_p<Mail>> recovered;
+	QFile doneLog;
+	QTimer commitTimer;
+	int active = -1;
+	quint64 nextId = 1;
+	qint64 segmentSize = 64 * 1024 * 1024;
+	qint64 dirtyBytes = 0;
+	bool isDirty = false;
+
+public:
+	MailSpool(const QString& path, QObject* parent = 0);
+	~MailSpool();
+
+	void SetCommitInterval(int ms) { commitTimer.setInterval(ms); }
+	void SetSegmentSize(qint64 bytes) { segmentSize = bytes; }
+	int Count() const { return entries.size(); }
+
+	bool Open();
+	QList<s_p<Mail>> TakeRecovered();
+	s_p<Mail> Append(const Mail& mail);
+	bool Load(const Mail& mail);
+	void Done(const Mail& mail);
+	void Defer(const Mail& mail);
+	void Commit();
+
+private:
+	bool OpenSegment(int number);
+	QString SegmentPath(int number) const;
+	void Unmap(const Mail& mail, Entry& entry);
+	void Release(int segment);
+
+private slots:
+	void StartCommitTimer();
+};
+}
+
+#endif // MAILSPOOLNYA_H
@@ -0,0 +1,139 @@
+#include "AttachmentNya.hpp"
+#include "CommonMail.hpp"
+#include "MailNya.hpp"
+
+#include <QDir>
+#include <cstring>
+
+#include "MailStreamNya.hpp"
+
+
+namespace Nya
+{
+MailStream::MailStream(const Mail& mail, int flags)
+	: mail(mail)
+	, flags(flags)
+{
+	for (auto i = mail.attachments.begin(); i != mail.attachments.end(); ++i)
+	{
+		names.append(i.key());
+		parts.append(i.value());
+	}
+	if (!mail.wireData.isEmpty() && (mail.wireFlags == flags || mail.wireFlags == 0))
+	{
+		stage = WireStage;
+		isStuffing = mail.wireFlags != flags && (flags & DotStuffing);
+	}
+}
+
+/**
+ * Next chunk of the message, at most maxSize bytes.
+ */
+QByteArray MailStream::Read(int maxSize)
+{
+	while (bufferPos == buffer.size() && stage != DoneStage) Fill();
+
+	QByteArray chunk = buffer.mid(bufferPos, maxSize);
+	bufferPos += chunk.size();
+	if (bufferPos == buffer.size())
+	{
+		buffer.clear();
+		bufferPos = 0;
+	}
+	return chunk;
+}
+
+/**
+ * Produce the next piece of the message.
+ */
+void MailStream::Fill()
+{
+	switch (stage)
+	{
+	case WireStage:
+		if (isStuffing)
+		{
+			FillStuffed();
+			break;
+		}
+		buffer = mail.wireData[segment];
+		if (++segment == mail.wireData.size()) stage = DoneStage;
+		break;
+	case TextStage:
+		buffer = mail.TextData(flags);
+		stage = parts.isEmpty() ? DoneStage : PartHeaderStage;
+		break;
+	case PartHeaderStage:
+		buffer = "--" + mail.boundary + "\r\n";
+		buffer += CreateEntity("Content-Disposition", QDir(names[part]).dirName(), "attachment; filename=", flags & Utf8Headers);
+		buffer += parts[part]->MimeHeader(flags & BinaryMime);
+		if ((flags & BinaryMime) || !AttachmentCache::Encode(*parts[part], encoded))
+		{
+			encoder.reset(new AttachmentEncoder(*parts[part], flags & BinaryMime));
+		}
+		stage = PartBodyStage;
+		break;
+	case PartBodyStage:
+		if (!encoder) // shared with the cache, copied out block by block like the encoder's
+		{
+			buffer = encoded.mid(encodedPos, AttachmentEncoder::BlockSize / 57 * AttachmentEncoder::LineSize);
+			encodedPos += buffer.size();
+			if (encodedPos == encoded.size())
+			{
+				encoded.clear();
+				encodedPos = 0;
+				stage = (++part < parts.count()) ? PartHeaderStage : EndStage;
+			}
+			break;
+		}
+		buffer.resize((flags & BinaryMime) ? AttachmentEncoder::BlockSize : AttachmentEncoder::BlockSize / 57 * AttachmentEncoder::LineSize);
+		buffer.resize(encoder->Read(buffer.data(), buffer.size()));
+		if (encoder->IsFailed())
+		{
+			isFailed = true;
+			encoder.reset();
+			buffer.clear();
+			stage = DoneStage;
+			break;
+		}
+		if (encoder->AtEnd())
+		{
+			encoder.reset();
+			stage = (++part < parts.count()) ? PartHeaderStage : EndStage;
+		}
+		break;
+	case EndStage:
+		buffer = "--" + mail.boundary + "--\r\n";
+		stage = DoneStage;
+		break;
+	default:;
+	}
+}
+
+/**
+ * Next block of wire data with the lines starting with '.' doubled.
+ */
+void MailStream::FillStuffed()
+{
+	static const int BlockSize = 64 * 1024;
+	const QByteArray& data = mail.wireData[segment];
+	const char* p = data.constData();
+	int end = qMin(data.size(), wirePos + BlockSize);
+	buffer.clear();
+	buffer.reserve(end - wirePos + 256);
+	while (wirePos < end)
+	{
+		if (isLineStart && p[wirePos] == '.') buffer += '.';
+		const char* lf = (const char*)memchr(p + wirePos, '\n', end - wirePos);
+		int next = lf ? int(lf - p) + 1 : end;
+		buffer.append(p + wirePos, next - wirePos);
+		isLineStart = lf != nullptr;
+		wirePos = next;
+	}
+	if (wirePos == data.size())
+	{
+		wirePos = 0;
+		if (++segment == mail.wireData.size()) stage = DoneStage;
+	}
+}
+}
@@ -0,0 +1,71 @@
+#ifndef MAILSTREAMNYA_H
+#define MAILSTREAMNYA_H
+
+#include "CommonMail.hpp"
+#include <QByteArray>
+#include <QList>
+#include <QStringList>
+
+
+namespace Nya
+{
+class Mail;
+class Attachment;
+class AttachmentEncoder;
+
+/**
+ * Rfc2822 serializer producing the message in bounded chunks.
+ * Attachments are encoded block by block, so the memory used
+ * does not depend on the attachment sizes. Bodies from AttachmentCache are shared
+ * with the cache and copied out block by block too.
+ * The mail must outlive the stream.
+ * A mail rendered by a template for the same flags is passed through as it is,
+ * wire data for flags 0 (7-bit, not dot-stuffed) is valid for any flags and is dot-stuffed as needed.
+ * Flags are TransferFlag values.
+ * An attachment that cannot be read to its end stops the stream with IsFailed(),
+ * what was produced must not be sent as a complete message.
+ */
+class MailStream
+{
+	enum Stage
+	{
+		WireStage,
+		TextStage,
+		PartHeaderStage,
+		PartBodyStage,
+		EndStage,
+		DoneStage
+	};
+
+	const Mail& mail;
+	int flags;
+	Stage stage = TextStage;
+	QStringList names;
+	QList<s_p<Attachment>> parts;
+	int part = 0;
+	int segment = 0;
+	int wirePos = 0;
+	bool isStuffing = false;
+	bool isLineStart = true;
+	bool isFailed = false;
+	s_p<AttachmentEncoder> encoder;
+	QByteArray encoded;
+	int encodedPos = 0;
+	QByteArray buffer;
+	int bufferPos = 0;
+
+public:
+	MailStream(const Mail& mail, int flags = DotStuffing);
+
+	bool AtEnd() const { return stage == DoneStage && bufferPos == buffer.size(); }
+	bool IsFailed() const { return isFailed; }
+	QByteArray Read(int maxSize = 64 * 1024);
+	void SkipText() { if (stage == TextStage) stage = parts.isEmpty() ? DoneStage : PartHeaderStage; }
+
+private:
+	void Fill();
+	void FillStuffed();
+};
+}
+
+#endif // MAILSTREAMNYA_H
@@ -0,0 +1,160 @@
+#include "AttachmentNya.hpp"
+#include "CommonMail.hpp"
+#include "MailNya.hpp"
+#include "MailStreamNya.hpp"
+
+#include <QMap>
+#include <QUuid>
+
+#include "MailTemplateNya.hpp"
+
+
+namespace Nya
+{
+/**
+ * Text with placeholders is sent as 8bit or quoted-printable,
+ * so that any substituted value fits the fixed headers.
+ */
+MailTemplate::MailTemplate(const Mail& source, int flags)
+	: mail(source)
+	, flags(flags)
+{
+	bool isUtf8 = flags & Utf8Headers;
+	bool isTextSlot = mail.text.contains("{{");
+	mail.Invalidate();
+	enc = mail.TextEncoding(flags);
+	if (isTextSlot && enc == 'a') enc = (flags & EightBit) ? '8' : 'q';
+
+	// per-recipient header values are replaced by markers, their lines become slots
+	Mail proto = mail;
+	QByteArray marker = "NyaSlot" + QUuid::createUuid().toRfc4122().toHex();
+	QHash<QByteArray, Segment> slots; // by the header line of the marker
+	auto addSlot = [&](SlotType type, const QByteArray& key, const QString& value)
+	{
+		QByteArray id = marker + QByteArray::number(slots.size());
+		slots.insert(CreateEntity(key, id, QByteArray(), isUtf8), Segment{type, key, value});
+		return QString(id);
+	};
+
+	proto.rcptTo = QStringList(addSlot(RecipientSlot, "To", QString()));
+	if (proto.subject.contains("{{")) proto.subject = addSlot(HeaderSlot, "Subject", proto.subject);
+	for (auto i = proto.extraHeaders.begin(); i != proto.extraHeaders.end(); ++i)
+	{
+		if (i.value().contains("{{")) i.value() = addSlot(HeaderSlot, i.key(), i.value()).toLatin1();
+	}
+
+	// fixed header lines between the slot lines
+	QByteArray header = proto.TextHeader(enc, flags);
+	QMap<int, QByteArray> slotLines; // by position
+	for (auto i = slots.begin(); i != slots.end(); ++i)
+	{
+		int pos = header.indexOf(i.key());
+		if (pos != -1) slotLines.insert(pos, i.key());
+	}
+	int pos = 0;
+	for (auto i = slotLines.begin(); i != slotLines.end(); ++i)
+	{
+		AddFixed(header.mid(pos, i.key() - pos));
+		segments.append(slots[i.value()]);
+		pos = i.key() + i.value().size();
+	}
+	AddFixed(header.mid(pos));
+
+	if (isTextSlot) segments.append(Segment{TextSlot, QByteArray(), mail.text});
+	else AddFixed(mail.EncodeText(mail.text, enc, flags & DotStuffing));
+
+	// attachment parts, encoded once
+	MailStream stream(proto, flags);
+	stream.SkipText();
+	QByteArray parts;
+	while (!stream.AtEnd()) parts += stream.Read();
+	AddFixed(parts);
+	mail.boundary = proto.boundary;
+}
+
+/**
+ * Fixed data, joined to the previous fixed segment.
+ */
+void MailTemplate::AddFixed(const QByteArray& data)
+{
+	if (data.isEmpty()) return;
+	if (!segments.isEmpty() && segments.last().type == FixedSlot) segments.last().data += data;
+	else segments.append(Segment{FixedSlot, data, QString()});
+}
+
+/**
+ * Message for the recipients as a list of buffers, the fixed ones are shared.
+ */
+QList<QByteArray> MailTemplate::Render(const QStringList& recipients, const QHash<QString, QString>& values) const
+{
+	bool isUtf8 = flags & Utf8Headers;
+	QList<QByteArray> data;
+	for (const Segment& segment : segments)
+	{
+		switch (segment.type)
+		{
+		case FixedSlot:
+			data.append(segment.data);
+			break;
+		case HeaderSlot:
+			data.append(CreateEntity(segment.data, Substitute(segment.value, values), QByteArray(), isUtf8));
+			break;
+		case RecipientSlot:
+			if (!recipients.isEmpty()) data.append(CreateEntity("To", recipients.join(", "), QByteArray(), isUtf8));
+			break;
+		case TextSlot:
+			data.append(mail.EncodeText(Substitute(segment.value, values), enc, flags & DotStuffing));
+			break;
+		}
+	}
+	return data;
+}
+
+/**
+ * Mail for the recipients, ready for Smtp::Send.
+ * Sent with the template flags, it is the rendered data as it is.
+ */
+s_p<Mail> MailTemplate::CreateMail(const QStringList& recipients, const QHash<QString, QString>& values) const
+{
+	s_p<Mail> result(new Mail(mail));
+	result->rcptTo = recipients;
+	result->subject = Substitute(mail.subject, values);
+	result->text = Substitute(mail.text, values);
+	for (auto i = result->extraHeaders.begin(); i != result->extraHeaders.end(); ++i)
+	{
+		if (i.value().contains("{{")) i.value() = Substitute(i.value(), values).toUtf8();
+	}
+	result->wireData = Render(recipients, values);
+	result->wireFlags = flags;
+	return result;
+}
+
+/**
+ * `{{name}}` placeholders replaced by their values, unknown ones are kept.
+ */
+QString MailTemplate::Substitute(const QString& value, const QHash<QString, QString>& values)
+{
+	QString result;
+	int pos = 0;
+	int start;
+	while ((start = value.indexOf("{{", pos)) != -1)
+	{
+		int end = value.indexOf("}}", start + 2);
+		if (end == -1) break;
+
+		auto i = values.find(value.mid(start + 2, end - start - 2).trimmed());
+		if (i == values.end())
+		{
+			result += value.mid(pos, end + 2 - pos);
+		}
+		else
+		{
+			result += value.mid(pos, start - pos);
+			result += i.value();
+		}
+		pos = end + 2;
+	}
+	result += value.mid(pos);
+	return result;
+}
+}
@@ -0,0 +1,59 @@
+#ifndef MAILTEMPLATENYA_H
+#define MAILTEMPLATENYA_H
+
+#include "CommonMail.hpp"
+#include "MailNya.hpp"
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QStringList>
+
+
+namespace Nya
+{
+/**
+ * Mail compiled once and rendered for many recipients.
+ * `{{name}}` placeholders in the subject, the text and the extra headers are substituted
+ * per recipient, and To is set per recipient. Everything else is encoded once
+ * and shared by the rendered mails: the fixed header lines, the text without
+ * placeholders and the attachment parts.
+ * A template renders for the transfer flags it is built with. The default, flags 0
+ * (7-bit, not dot-stuffed), is sent as it is by any session, DATA or BDAT, with or
+ * without 8BITMIME; other flags are reused only by sessions with exactly the same ones.
+ */
+class MailTemplate
+{
+	enum SlotType
+	{
+		FixedSlot,
+		HeaderSlot,
+		RecipientSlot,
+		TextSlot
+	};
+
+	struct Segment
+	{
+		SlotType type;
+		QByteArray data; // encoded, or the header key
+		QString value; // with placeholders
+	};
+
+	Mail mail;
+	int flags;
+	char enc;
+	QList<Segment> segments;
+
+public:
+	MailTemplate(const Mail& mail, int flags = 0);
+
+	QList<QByteArray> Render(const QStringList& recipients, const QHash<QString, QString>& values) const;
+	s_p<Mail> CreateMail(const QStringList& recipients, const QHash<QString, QString>& values) const;
+
+	static QString Substitute(const QString& value, const QHash<QString, QString>& values);
+
+private:
+	void AddFixed(const QByteArray& data);
+};
+}
+
+#endif // MAILTEMPLATENYA_H
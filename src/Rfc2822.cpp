@@ -1,230 +1,337 @@
 #include "AttachmentNya.hpp"
+#include "Base64.hpp"
 #include "CommonMail.hpp"
 #include "MailNya.hpp"
 
-#include <QRegExp>
+#include <QFile>
 #include <QTextCodec>
 #include <QTextStream>
+#include <cstring>
 
 #include "Rfc2822.hpp"
 
 
 namespace Nya
 {
+static inline bool IsWsp(char c) { return c == ' ' || c == '\t'; }
+static inline bool IsFieldChar(char c) { return c >= '!' && c <= '~' && c != ':'; }
+
 /**
- * Parse all.
+ * End of the line content at pos (CRLF or LF), `next` is set to the next line.
  */
-void Rfc2822::Parse(const QByteArray& buffer)
+static int LineEnd(const char* data, int pos, int size, int& next)
 {
-	ParseEntity(buffer, mail->extraHeaders, mail->text);
-	ParseBody();
+	const char* lf = (const char*)memchr(data + pos, '\n', size - pos);
+	if (!lf)
+	{
+		next = size;
+		return size;
+	}
+	int end = int(lf - data);
+	next = end + 1;
+	return (end > pos && data[end - 1] == '\r') ? end - 1 : end;
 }
 
 /**
- * Entity.
+ * Header section starting at pos.
+ * Values are unfolded and their encoded words decoded to UTF-8, keys are lower case.
+ * Malformed lines are skipped with their continuation lines.
+ * Returns the position of the body, after the empty line.
  */
-void Rfc2822::ParseEntity(const QByteArray& buffer, QHash<QByteArray, QByteArray>& headers, QString& body)
+int Rfc2822::ParseHeaders(const QByteArray& buffer, int pos, QHash<QByteArray, QByteArray>& headers)
 {
-	int pos = 0;
-	int crlfPos = 0;
-	QByteArray line;
-	currentHeaderKey = QByteArray();
-	currentHeaderValue.clear();
-
-	bool isHeaders = true;
-	while (true)
+	const char* data = buffer.constData();
+	int size = buffer.size();
+	while (pos < size)
 	{
-		crlfPos = buffer.indexOf("\r\n", pos);
-		if (crlfPos == -1)
-		{
-			break;
-		}
-		if (isHeaders && crlfPos == pos)  // double CRLF reached: end of headers section
+		int next;
+		int lineEnd = LineEnd(data, pos, size, next);
+		if (lineEnd == pos) return next; // empty line: end of headers section
+
+		int colon = pos;
+		while (colon < lineEnd && IsFieldChar(data[colon])) ++colon;
+		bool isField = colon > pos && colon < lineEnd && data[colon] == ':';
+		QByteArray key(data + pos, colon - pos);
+
+		int valuePos = isField ? colon + 1 : lineEnd;
+		while (valuePos < lineEnd && IsWsp(data[valuePos])) ++valuePos;
+		QByteArray value(data + valuePos, lineEnd - valuePos);
+
+		// continuation lines, unfolding keeps their leading WSP
+		for (pos = next; pos < size && IsWsp(data[pos]); pos = next)
 		{
-			isHeaders = false;
-			ParseHeader("", headers); // to store the header currently being parsed (last one)
-			pos += 2;
-			continue;
+			lineEnd = LineEnd(data, pos, size, next);
+			if (isField) value.append(data + pos, lineEnd - pos);
 		}
-		line = buffer.mid(pos, crlfPos - pos);
-		pos = crlfPos + 2;
 
-		if( isHeaders ) ParseHeader(line, headers);
-		else body.append(line + "\r\n");
+		if (isField) headers[key.toLower()] = DecodeValue(value);
 	}
+	return size;
 }
 
 /**
- * Header.
+ * Content-Disposition: attachment, with or without parameters.
  */
-void Rfc2822::ParseHeader(const QByteArray& line, QHash<QByteArray, QByteArray>& headers)
+static bool IsAttachment(const MimePart& part)
 {
-	QRegExp spRe("^[ \\t]");
-	QRegExp hdrRe("^([!-9;-~]+):[ \\t](.*)$");
-	if (spRe.indexIn(line) == 0) // continuation line
-	{
-		currentHeaderValue.append(line);
-	}
-	else
+	QByteArray disposition = part.headers.value("content-disposition");
+	if (qstrnicmp(disposition.constData(), "attachment", 10) != 0) return false;
+	return disposition.size() == 10 || disposition[10] == ';' || disposition[10] == ' ' || disposition[10] == '\t';
+}
+
+/**
+ * Parse all.
+ * The text is the message body with the attachment parts cut out, at any depth.
+ */
+void Rfc2822::Parse(const QByteArray& buffer)
+{
+	QList<MimePart> parts = ParseMime(buffer);
+	const char* data = buffer.constData();
+	mail->extraHeaders = parts[0].headers;
+
+	QByteArray text;
+	int pos = parts[0].bodyPos;
+	for (int i = 1; i < parts.size(); ++i)
 	{
-		// starting a new header field. Store the current one before
-		if (!currentHeaderKey.isEmpty())
+		const MimePart& part = parts[i];
+		if (part.begin < pos || !IsAttachment(part)) continue; // inside a part already cut out
+
+		QString filename;
+		if (auto a = ParseAttachment(buffer, part, filename))
 		{
-			QString value = UnfoldValue(currentHeaderValue);
-			headers[currentHeaderKey.toLower()] = value.toUtf8();
-			currentHeaderKey = QByteArray();
-			currentHeaderValue.clear();
+			mail->attachments.insert(filename, a);
 		}
-		if (hdrRe.exactMatch(line))
-		{
-			currentHeaderKey = hdrRe.cap(1).toUtf8();
-			currentHeaderValue.append(hdrRe.cap(2));
-		} // else: empty or malformed header line. Ignore.
+		text.append(data + pos, part.begin - pos);
+		pos = part.end;
 	}
+	text.append(data + pos, parts[0].bodyEnd - pos);
+	mail->text = QString::fromUtf8(text);
 }
 
+static const int MaxMimeDepth = 16;
+
 /**
- * Extract the attachments from a multipart body.
- * Proceed only one level deep.
+ * MIME tree of the message in one pass over the buffer, nothing is copied but the headers.
+ * Parts are listed in document order, the message itself first.
  */
-void Rfc2822::ParseBody()
+QList<MimePart> Rfc2822::ParseMime(const QByteArray& buffer)
 {
-	QString& text = mail->text;
-	if (!mail->extraHeaders.contains("content-type")) return;
-	QString contentType = mail->extraHeaders["content-type"];
-	if (!contentType.indexOf("multipart",0,Qt::CaseInsensitive) == 0) return;
-
-	// extract the boundary delimiter
-	QRegExp boundaryRe("boundary=\"?([^\"]*)\"?(?=;|$)");
-	if (boundaryRe.indexIn(contentType) == -1)
+	QList<MimePart> parts;
+	MimePart message;
+	message.bodyPos = ParseHeaders(buffer, 0, message.headers);
+	message.bodyEnd = message.end = buffer.size();
+	parts.append(message);
+	ParseMultipart(buffer, 0, parts, 0);
+	return parts;
+}
+
+/**
+ * Delimiter line `--boundary` or `--boundary--` at the start of a line in [from, to).
+ * Returns its position or -1, `next` is set to the line after it.
+ */
+static int FindDelimiter(const QByteArray& buffer, const QByteArray& delimiter, int from, int to, int& next, bool& isClose)
+{
+	const char* data = buffer.constData();
+	for (int pos = from; (pos = buffer.indexOf(delimiter, pos)) != -1 && pos + delimiter.size() <= to; ++pos)
 	{
-		qDebug("Boundary regexp didn't match for %s", contentType.toLatin1().data());
-		return;
+		if (pos != from && data[pos - 1] != '\n') continue;
+
+		int lineEnd = pos + delimiter.size();
+		isClose = lineEnd + 1 < to && data[lineEnd] == '-' && data[lineEnd + 1] == '-';
+		if (isClose) lineEnd += 2;
+		while (lineEnd < to && IsWsp(data[lineEnd])) ++lineEnd;
+		if (lineEnd < to && data[lineEnd] == '\r') ++lineEnd;
+		if (lineEnd < to && data[lineEnd] != '\n') continue; // boundary is only a prefix of this line
+
+		next = (lineEnd < to) ? lineEnd + 1 : to;
+		return pos;
 	}
+	return -1;
+}
 
-	// find boundary delimiters in the body
-	QString boundary = boundaryRe.cap(1);
-	QRegExp bndRe(QString("(^|\\r?\\n)--%1(--)?[ \\t]*\\r?\\n").arg(QRegExp::escape(boundary)));
-	if (!bndRe.isValid())
+/**
+ * Children of the part at `index`, if it is a multipart, appended after it.
+ * The line break before a delimiter belongs to the delimiter.
+ */
+void Rfc2822::ParseMultipart(const QByteArray& buffer, int index, QList<MimePart>& parts, int depth)
+{
+	QByteArray contentType = parts[index].headers.value("content-type");
+	if (depth >= MaxMimeDepth || qstrnicmp(contentType.constData(), "multipart/", 10) != 0) return;
+	QByteArray boundary = HeaderParam(contentType, "boundary");
+	if (boundary.isEmpty()) return;
+
+	const char* data = buffer.constData();
+	QByteArray delimiter = "--" + boundary;
+	int from = parts[index].bodyPos;
+	int to = parts[index].bodyEnd;
+	int current = -1; // part before the delimiter, its headers start at bodyPos
+	int pos = from;
+	int next = from;
+	bool isClose = false;
+	while (true)
 	{
-		qDebug("regexp %s not valid ! %s", bndRe.pattern().toLatin1().data(), bndRe.errorString().toLatin1().data());
+		pos = FindDelimiter(buffer, delimiter, next, to, next, isClose);
+		if (current != -1)
+		{
+			MimePart& part = parts[current];
+			part.end = (pos == -1) ? to : pos;
+			part.bodyEnd = part.end;
+			if (pos != -1 && part.bodyEnd > part.bodyPos && data[part.bodyEnd - 1] == '\n') --part.bodyEnd;
+			if (pos != -1 && part.bodyEnd > part.bodyPos && data[part.bodyEnd - 1] == '\r') --part.bodyEnd;
+
+			// headers must not run into the next part
+			part.bodyPos = qMin(ParseHeaders(QByteArray::fromRawData(data, part.bodyEnd), part.bodyPos, part.headers), part.bodyEnd);
+			ParseMultipart(buffer, current, parts, depth + 1);
+		}
+		if (pos == -1 || isClose) break;
+
+		MimePart part;
+		part.parent = index;
+		part.begin = pos;
+		part.bodyPos = next;
+		current = parts.size();
+		parts.append(part);
 	}
+}
 
-	// keep track of the position of two consecutive boundary delimiters:
-	// begin* is the position of the delimiter first character,
-	// end* is the position of the first character of the part following it.
-	int beginFirst = 0;
-	int endFirst = 0;
-	int beginSecond = 0;
-	int endSecond = 0;
-	while(bndRe.indexIn(text, endSecond) != -1)
+/**
+ * Parameter of a structured header value, such as the boundary of a Content-Type.
+ */
+QByteArray Rfc2822::HeaderParam(const QByteArray& value, const char* name)
+{
+	const char* data = value.constData();
+	int size = value.size();
+	int nameLen = int(strlen(name));
+	for (int pos = value.indexOf(';'); pos != -1; pos = value.indexOf(';', pos))
 	{
-		beginSecond = bndRe.pos() + bndRe.cap(1).length(); // add length of preceding line break, if any
-		endSecond = bndRe.pos() + bndRe.matchedLength();
+		++pos;
+		while (pos < size && IsWsp(data[pos])) ++pos;
+		if (pos + nameLen >= size || data[pos + nameLen] != '=' || qstrnicmp(data + pos, name, nameLen) != 0) continue;
 
-		if (endFirst != 0)
+		pos += nameLen + 1;
+		if (pos < size && data[pos] == '"')
 		{
-			// handle part here:
-			QByteArray part = text.mid(endFirst, beginSecond - endFirst).toLocal8Bit();
-			QHash<QByteArray, QByteArray> partHeaders;
-			QString partBody;
-			ParseEntity(part, partHeaders, partBody);
-
-			if (partHeaders.contains("content-disposition") && partHeaders["content-disposition"].indexOf("attachment;") == 0)
-			{
-				QString filename;
-				if (auto a = ParseAttachment(partHeaders, partBody, filename))
-				{
-					mail->attachments.insert(filename, a);
-				}
-				// strip part from body
-				text.replace(beginFirst, beginSecond - beginFirst, "");
-				beginSecond = beginFirst;
-				endSecond = endFirst;
-			}
+			int end = value.indexOf('"', pos + 1);
+			return value.mid(pos + 1, ((end == -1) ? size : end) - pos - 1);
 		}
-		beginFirst = beginSecond;
-		endFirst = endSecond;
+		int end = pos;
+		while (end < size && data[end] != ';' && !IsWsp(data[end])) ++end;
+		return value.mid(pos, end - pos);
 	}
+	return QByteArray();
+}
+
+/**
+ * Charset conversion to UTF-8, unknown charsets give nothing.
+ */
+static QByteArray ToUtf8(const QByteArray& charset, const QByteArray& data)
+{
+	if (data.isEmpty()) return data;
+	if (qstricmp(charset.constData(), "utf-8") == 0 || qstricmp(charset.constData(), "us-ascii") == 0) return data;
+
+	QTextCodec* codec = QTextCodec::codecForName(charset);
+	return codec ? codec->toUnicode(data).toUtf8() : QByteArray();
 }
 
-QString Rfc2822::UnfoldValue(QStringList& folded)
+/**
+ * Header value with encoded words (RFC 2047) decoded to UTF-8.
+ * Adjacent encoded words are joined before the charset conversion,
+ * so characters split between them survive, and the whitespace between them is dropped.
+ */
+QByteArray Rfc2822::DecodeValue(const QByteArray& value)
 {
-	QString unfolded;
-	QRegExp encRe("=\\?([^? \\t]+)\\?([qQbB])\\?([^? \\t]+)\\?="); // search for an encoded word
-	QStringList::iterator i;
-	for (i = folded.begin(); i != folded.end(); ++i)
+	if (!value.contains("=?")) return value;
+
+	const char* data = value.constData();
+	int size = value.size();
+	QByteArray result;
+	QByteArray charset;
+	QByteArray decoded; // of the adjacent encoded words in `charset`
+	int pos = 0; // text before it is in the result
+	int search = 0;
+	while ((search = value.indexOf("=?", search)) != -1)
 	{
-		int offset = 0;
-		while (encRe.indexIn(*i, offset) != -1)
+		// =?charset?encoding?text?=
+		int wordPos = search;
+		int charsetEnd = wordPos + 2;
+		while (charsetEnd < size && data[charsetEnd] != '?' && !IsWsp(data[charsetEnd])) ++charsetEnd;
+		int textPos = charsetEnd + 3;
+		int textEnd = textPos;
+		while (textEnd < size && data[textEnd] != '?' && !IsWsp(data[textEnd])) ++textEnd;
+		char encoding = (charsetEnd + 2 < size) ? (data[charsetEnd + 1] | 0x20) : 0;
+		if (charsetEnd == wordPos + 2 || textPos > size || data[charsetEnd] != '?' ||
+			(encoding != 'q' && encoding != 'b') || data[charsetEnd + 2] != '?' ||
+			textEnd == textPos || textEnd + 1 >= size || data[textEnd] != '?' || data[textEnd + 1] != '=')
+		{
+			search += 2;
+			continue;
+		}
+
+		// RFC 2231 language suffix: charset*language
+		QByteArray wordCharset(data + wordPos + 2, charsetEnd - wordPos - 2);
+		int star = wordCharset.indexOf('*');
+		if (star != -1) wordCharset.truncate(star);
+
+		bool isAdjacent = !decoded.isEmpty();
+		for (int i = pos; i < wordPos && isAdjacent; ++i) isAdjacent = IsWsp(data[i]);
+		if (!isAdjacent || qstricmp(wordCharset.constData(), charset.constData()) != 0)
 		{
-			QString decoded = Decode(encRe.cap(1), encRe.cap(2).toLower(), encRe.cap(3));
-			i->replace(encRe.pos(), encRe.matchedLength(), decoded);  // replace encoded word with decoded one
-			offset = encRe.pos() + decoded.length(); // set offset after the inserted decoded word
+			result += ToUtf8(charset, decoded);
+			decoded.clear();
+			charset = wordCharset;
 		}
+		if (!isAdjacent) result.append(data + pos, wordPos - pos);
+
+		decoded += Decode(encoding, QByteArray::fromRawData(data + textPos, textEnd - textPos));
+		pos = search = textEnd + 2;
 	}
-	unfolded = folded.join("");
-	return unfolded;
+	result += ToUtf8(charset, decoded);
+	result.append(data + pos, size - pos);
+	return result;
 }
 
 /**
- * Decode.
+ * Decode the text of an encoded word, 'q' or 'b'.
  */
-QString Rfc2822::Decode(const QString& charset, const QString& encoding, const QString& encoded)
+QByteArray Rfc2822::Decode(char encoding, const QByteArray& encoded)
 {
-	QString rv;
+	if (encoding == 'b') return FromBase64(encoded);
+
 	QByteArray buf;
-	if (encoding == "q")
+	buf.reserve(encoded.size());
+	int len = encoded.length();
+	for (int i = 0; i < len; i++)
 	{
-		QByteArray src = encoded.toLatin1();
-		int len = src.length();
-		for (int i = 0; i < len; i++)
+		if (encoded[i] == '_')
 		{
-			if (src[i] == '_')
-			{
-				buf += 0x20;
-			}
-			else if (src[i] == '=')
-			{
-				if (i+2 < len)
-				{
-					buf += QByteArray::fromHex(src.mid(i+1,2));
-					i += 2;
-				}
-			}
-			else
+			buf += 0x20;
+		}
+		else if (encoded[i] == '=')
+		{
+			if (i+2 < len)
 			{
-				buf += src[i];
+				buf += QByteArray::fromHex(encoded.mid(i+1,2));
+				i += 2;
 			}
 		}
+		else
+		{
+			buf += encoded[i];
+		}
 	}
-	else if (encoding == "b")
-	{
-		buf = QByteArray::fromBase64(encoded.toLatin1());
-	}
-	QTextCodec *codec = QTextCodec::codecForName(charset.toLatin1());
-	if (codec)
-	{
-		rv = codec->toUnicode(buf);
-	}
-	return rv;
+	return buf;
 }
 
 /**
- * Attachment.
+ * Attachment, its content is decoded from the buffer only when it is read.
  */
-s_p<Attachment> Rfc2822::ParseAttachment(const QHash<QByteArray, QByteArray>& headers, const QString& body, QString& filename)
+s_p<Attachment> Rfc2822::ParseAttachment(const QByteArray& buffer, const MimePart& part, QString& filename)
 {
-	static int count = 1;
-	QByteArray content;
-	QRegExp filenameRe(";\\s+filename=\"?([^\"]*)\"?(?=;|$)");
-	if (filenameRe.indexIn(headers["content-disposition"]) != -1)
+	const QHash<QByteArray, QByteArray>& headers = part.headers;
+	filename = HeaderParam(headers["content-disposition"], "filename");
+	if (filename.isEmpty())
 	{
-		filename = filenameRe.cap(1);
-	}
-	else
-	{
-		filename = QString("attachment%1").arg(count);
+		filename = QString("attachment%1").arg(mail->attachments.size() + 1);
 	}
 
 	QByteArray contentType;
@@ -237,18 +344,26 @@ s_p<Attachment> Rfc2822::ParseAttachment(const QHash<QByteArray, QByteArray>& he
 		contentType = "application/octet-stream";
 	}
 
-	QString cte;
-	if (headers.contains("content-transfer-encoding"))
-	{
-		cte = headers["content-transfer-encoding"].toLower();
-	}
+	QByteArray cte = headers["content-transfer-encoding"].toLower();
+	PartDevice* device = new PartDevice(buffer, part.bodyPos, part.bodyEnd - part.bodyPos, cte, IsText(contentType), file);
+	s_p<Attachment> a(new Attachment(device, contentType));
+	a->GetExtraHeaders() = headers;
+	return a;
+}
+
+/**
+ * Content of a part body by its Content-Transfer-Encoding.
+ */
+QByteArray Rfc2822::DecodeBody(const QByteArray& body, const QByteArray& cte, bool isText)
+{
+	QByteArray content;
 	if ( cte == "base64")
 	{
-		content = QByteArray::fromBase64(body.toLatin1());
+		content = FromBase64(body);
 	}
 	else if (cte == "quoted-printable")
 	{
-		QByteArray src = body.toLatin1();
+		const QByteArray& src = body;
 		int len = src.length();
 		QTextStream dest(&content);
 		for (int i = 0; i < len; i++)
@@ -281,14 +396,49 @@ s_p<Attachment> Rfc2822::ParseAttachment(const QHash<QByteArray, QByteArray>& he
 	}
 	else // assume 7bit or 8bit
 	{
-		content = body.toLocal8Bit();
-		if (IsText(contentType))
+		content = QByteArray(body.constData(), body.size());
+		if (isText)
 		{
 			content.replace("\r\n","\n");
 		}
 	}
-	s_p<Attachment> a(new Attachment(content, contentType));
-	a->GetExtraHeaders() = headers;
-	return a;
+	return content;
+}
+
+//==============================================================================
+PartDevice::PartDevice(const QByteArray& buffer, int pos, int len, const QByteArray& cte, bool isText, s_p<QFile> file)
+	: file(file)
+	, buffer(buffer)
+	, bodyPos(pos)
+	, bodyLen(len)
+	, cte(cte)
+	, isText(isText)
+{}
+
+/**
+ * Decode the body, read only.
+ */
+bool PartDevice::open(OpenMode mode)
+{
+	if (mode & WriteOnly) return false;
+	content = Rfc2822::DecodeBody(QByteArray::fromRawData(buffer.constData() + bodyPos, bodyLen), cte, isText);
+	return QIODevice::open(mode);
+}
+
+/**
+ * Drop the decoded content.
+ */
+void PartDevice::close()
+{
+	QIODevice::close();
+	content = QByteArray();
+}
+
+qint64 PartDevice::readData(char* data, qint64 maxSize)
+{
+	qint64 len = qMin(maxSize, qint64(content.size()) - pos());
+	if (len <= 0) return 0;
+	memcpy(data, content.constData() + pos(), len);
+	return len;
 }
 }
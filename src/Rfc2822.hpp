@@ -3,32 +3,79 @@
 
 #include "CommonMail.hpp"
 #include <QByteArray>
+#include <QHash>
+#include <QIODevice>
+#include <QList>
 #include <QStringList>
 
 
+class QFile;
+
 namespace Nya
 {
 class Mail;
 class Attachment;
 
+/**
+ * Entity of a MIME tree as offsets into the parsed buffer.
+ * [begin, end) spans the part with its delimiter line, the body is [bodyPos, bodyEnd).
+ */
+struct MimePart
+{
+	QHash<QByteArray, QByteArray> headers;
+	int parent = -1; // index of the enclosing multipart, -1 for the message
+	int begin = 0;
+	int bodyPos = 0;
+	int bodyEnd = 0;
+	int end = 0;
+};
+
+/**
+ * Read-only device over a part body in the parsed buffer.
+ * The buffer is shared, not copied, and the body is decoded when the device is opened.
+ * A mapped file behind the buffer is kept open as long as the device.
+ */
+class PartDevice : public QIODevice
+{
+	s_p<QFile> file;
+	QByteArray buffer;
+	int bodyPos;
+	int bodyLen;
+	QByteArray cte;
+	bool isText;
+	QByteArray content;
+
+public:
+	PartDevice(const QByteArray& buffer, int pos, int len, const QByteArray& cte, bool isText, s_p<QFile> file = nullptr);
+
+	bool open(OpenMode mode) override;
+	void close() override;
+	qint64 size() const override { return content.size(); }
+
+protected:
+	qint64 readData(char* data, qint64 maxSize) override;
+	qint64 writeData(const char*, qint64) override { return -1; }
+};
+
 class Rfc2822
 {
 	Mail* mail;
-	QByteArray currentHeaderKey;
-	QStringList currentHeaderValue;
+	s_p<QFile> file;
 
 public:
-	Rfc2822(Mail* mail) : mail(mail) {}
+	Rfc2822(Mail* mail, s_p<QFile> file = nullptr) : mail(mail), file(file) {}
 
 	void Parse(const QByteArray& buffer);
+	static int ParseHeaders(const QByteArray& buffer, int pos, QHash<QByteArray, QByteArray>& headers);
+	static QList<MimePart> ParseMime(const QByteArray& buffer);
+	static QByteArray HeaderParam(const QByteArray& value, const char* name);
+	static QByteArray DecodeBody(const QByteArray& body, const QByteArray& cte, bool isText);
 
 private:
-	void ParseHeader(const QByteArray& line, QHash<QByteArray, QByteArray>& headers);
-	void ParseBody();
-	void ParseEntity(const QByteArray& buffer, QHash<QByteArray, QByteArray>& headers, QString& body);
-	s_p<Attachment> ParseAttachment(const QHash<QByteArray, QByteArray>& headers, const QString& body, QString& filename);
-	QString UnfoldValue(QStringList& folded);
-	QString Decode(const QString& charset, const QString& encoding, const QString& encoded);
+	static void ParseMultipart(const QByteArray& buffer, int index, QList<MimePart>& parts, int depth);
+	s_p<Attachment> ParseAttachment(const QByteArray& buffer, const MimePart& part, QString& filename);
+	static QByteArray DecodeValue(const QByteArray& value);
+	static QByteArray Decode(char encoding, const QByteArray& encoded);
 };
 }
 
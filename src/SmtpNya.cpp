@@ -1,6 +1,9 @@
 #include "MailNya.hpp"
+#include "MailSpoolNya.hpp"
+#include "MailStreamNya.hpp"
 
 #include <QCryptographicHash>
+#include <QMutex>
 #include <QStringList>
 #include <QTcpSocket>
 #include <QThread>
@@ -14,7 +17,14 @@
 
 namespace Nya
 {
-static QByteArray ExtractAddress(const QString& address)
+static const int BodyChunkSize = 64 * 1024;
+static const qint64 BodyBufferLimit = 4 * BodyChunkSize;
+static const int CoalesceWindow = 256;
+
+static QMutex ehloMutex;
+static QByteArray ehloDefault;
+
+static QByteArray ExtractAddress(const QString& address, bool isUtf8 = false)
 {
 	int parenDepth = 0;
 	int addrStart = -1;
@@ -32,7 +42,10 @@ static QByteArray ExtractAddress(const QString& address)
 		else if (addrStart != -1)
 		{
 			if (ch == '>')
-				return address.mid(addrStart, (i - addrStart)).toLatin1();
+			{
+				QString mailbox = address.mid(addrStart, (i - addrStart));
+				return isUtf8 ? mailbox.toUtf8() : mailbox.toLatin1();
+			}
 		}
 		else if (ch == '(')
 		{
@@ -54,7 +67,7 @@ static QByteArray ExtractAddress(const QString& address)
 				addrStart = i + 1;
 		}
 	}
-	return address.toLatin1();
+	return isUtf8 ? address.toUtf8() : address.toLatin1();
 }
 
 //===============================================================================
@@ -195,6 +208,12 @@ Smtp::Smtp(const QString& host, const QByteArray& username, const QByteArray& pa
 	, allowedAuthTypes(AuthPlain | AuthLogin | AuthCramMD5)
 	, defaultSender(username)
 {
+	// signal signatures spell the types as declared, with or without the s_p macro expanded
+	qRegisterMetaType<s_p<Mail>>();
+	qRegisterMetaType<s_p<Mail>>("s_p<Mail>");
+	qRegisterMetaType<s_p<Mail>>("std::shared_ptr<Mail>");
+	qRegisterMetaType<SmtpStats>();
+	qRegisterMetaType<SmtpStats>("SmtpStats");
 #ifndef QT_NO_OPENSSL
 	socket = new QSslSocket(this);
 #else
@@ -202,6 +221,11 @@ Smtp::Smtp(const QString& host, const QByteArray& username, const QByteArray& pa
 #endif
 	connect(socket, SIGNAL(error(QAbstractSocket::SocketError)), SLOT(OnSocketError(QAbstractSocket::SocketError)));
 	connect(socket, SIGNAL(readyRead()), SLOT(OnSocketRead()));
+	connect(socket, SIGNAL(bytesWritten(qint64)), SLOT(OnSocketBytesWritten(qint64)));
+	connect(socket, SIGNAL(connected()), SLOT(OnSocketConnected()));
+#ifndef QT_NO_OPENSSL
+	connect(socket, SIGNAL(encrypted()), SLOT(OnSocketEncrypted()));
+#endif
 
 	if( !parent )
 	{
@@ -218,7 +242,18 @@ void Smtp::Connect()
 {
 	if( state != Disconnected ) return;
 
+	if (clock.isValid())
+	{
+		QMutexLocker locker(&statsMutex);
+		stats.reconnects++;
+	}
+	else clock.start();
+	EnterStage(ConnectStage);
+
 	state = StartState;
+	buffer.clear();
+	expected.clear();
+	body.reset();
 #ifndef QT_NO_OPENSSL
 	((QSslSocket*)socket)->connectToHostEncrypted(host, port);
 #else
@@ -236,19 +271,61 @@ void Smtp::Disconnect()
 
 /**
  * Send mail.
+ * Urgent mail goes before anything else queued, bulk mail after everything else,
+ * and the bulk tenants share the connection by their weights (1 by default).
+ * With SetCoalescing(n), queued mails with the same content go in one transaction
+ * of at most n recipients, and each of them is still reported on its own.
+ * Returns the mail the signals will carry: its spooled copy with SetSpool, or the mail itself.
  */
-void Smtp::Send(s_p<Mail> mail)
+s_p<Mail> Smtp::Send(s_p<Mail> mail, MailPriority priority, const QByteArray& tenant)
 {
-	pending.append(mail);
+	if (spool)
+	{
+		s_p<Mail> spooled = spool->Append(*mail);
+		if (spooled) mail = spooled;
+	}
+	if (priority == UrgentPriority) urgent.mails.append(mail);
+	else if (priority == NormalPriority) normal.mails.append(mail);
+	else bulk[tenant].mails.append(mail);
+	queued++;
 	if( state == Waiting ) SendNext();
+	return mail;
+}
+
+/**
+ * Totals of the session so far, a snapshot that may be taken from any thread.
+ * The totals of each mail come with SignalStats.
+ */
+SmtpStats Smtp::Stats() const
+{
+	QMutexLocker locker(&statsMutex);
+	return stats;
+}
+
+/**
+ * Queue mails on disk from now on, and send the ones the spool recovered.
+ * The signals then carry the spooled copy of a mail, with the same envelope, see Send().
+ * The spool, which must have no parent, moves to the thread of this Smtp.
+ */
+void Smtp::SetSpool(s_p<MailSpool> spool)
+{
+	this->spool = spool;
+	if (spool)
+	{
+		if (spool->thread() != thread()) spool->moveToThread(thread());
+		QList<s_p<Mail>> recovered = spool->TakeRecovered();
+		normal.mails += recovered;
+		queued += recovered.size();
+	}
+	if (state == Waiting) SendNext();
 }
 
 /**
  * Parse ehlo.
  */
-void Smtp::ParseEhlo(const QByteArray& code, bool cont, const QString& line)
+void Smtp::ParseEhlo(const SmtpReply& reply)
 {
-	if( code != "250" )
+	if( reply.code != 250 )
 	{
 		// error!
 		if (state != HeloSent)
@@ -266,26 +343,14 @@ void Smtp::ParseEhlo(const QByteArray& code, bool cont, const QString& line)
 		}
 		return;
 	}
-	else if( state != EhloGreetReceived )
-	{
-		if( !cont )
-		{
-			// greeting only, no extensions
-			state = EhloDone;
-		}
-		else
-		{
-			// greeting followed by extensions
-			state = EhloGreetReceived;
-			return;
-		}
-	}
-	else
+
+	// greeting followed by extensions, one per line
+	for (int i = 1; i < reply.lines.count(); ++i)
 	{
+		QString line = reply.lines[i].mid(4);
 		extensions[line.section(' ', 0, 0).toUpper()] = line.section(' ', 1);
-		if( !cont ) state = EhloDone;
 	}
-	if (state != EhloDone) return;
+	state = EhloDone;
 	if (extensions.contains("STARTTLS")) StartTLS();
 	else Authenticate();
 }
@@ -298,6 +363,7 @@ void Smtp::StartTLS()
 #ifndef QT_NO_OPENSSL
 	socket->write("starttls\r\n");
 	state = StartTLSSent;
+	EnterStage(TlsStage);
 #else
 	Authenticate();
 #endif
@@ -315,6 +381,7 @@ void Smtp::Authenticate()
 	}
 	else
 	{
+		EnterStage(AuthStage);
 		QStringList auth = extensions["AUTH"].toUpper().split(' ', QString::SkipEmptyParts);
 		if (auth.contains("CRAM-MD5") && (allowedAuthTypes & AuthCramMD5))
 		{
@@ -405,97 +472,231 @@ void Smtp::AuthenticateLogin()
 }
 
 /**
- * Send next mail.
+ * Reply to a command of the mail transaction.
+ * Replies come in the order of the commands, pipelined or not.
  */
-void Smtp::SendMail(const QByteArray& code, const QByteArray& line)
+void Smtp::SendMail(int code, const QByteArray& line)
 {
-	if( !pending.count() ) return;
+	if( !pending.count() || expected.isEmpty() ) return;
 	s_p<Mail> mail = pending.first();
 
-	if (code[0] != '2')
+	switch (expected.takeFirst())
 	{
-		// on failure, emit a warning signal
-		if (!mailAck)
+	case MailFromCommand:
+		if (code / 100 != 2)
+		{
+			isSenderRejected = true;
+			isTransient |= code / 100 == 4;
+			mailStats.rejections++;
+			MailError(QString("Sender rejected: %1 - %2").arg(QString(line)).arg(mail->GetSender()));
+		}
+		break;
+	case RcptToCommand:
+		if (isSenderRejected)
+		{
+			// pipelined after a refused sender, the 503s add nothing to the error already reported
+		}
+		else if (code / 100 != 2)
 		{
-			emit SignalError(QString("Sender rejected: %1 - %2").arg(QString(line)).arg(mail->GetSender()));
+			isTransient |= code / 100 == 4;
+			mailStats.rejections++;
+			emit SignalError(QString("Recipient rejected: %1 - %2").arg(QString(line)).arg(recipients[rcptReplied]));
 		}
 		else
 		{
-			emit SignalError(QString("Recipient rejected: %1 - %2").arg(QString(line)).arg(mail->GetSender()));
+			rcptAck++;
+			recipientAcks[rcptReplied] = true;
 		}
+		rcptReplied++;
+		break;
+	case DataCommand:
+		SendBody(code, line);
+		return;
+	case BodyCommand:
+		FinishMail(code, line);
+		return;
+	case BdatCommand:
+		if (code / 100 != 2 && !isBodyFailed)
+		{
+			// no more chunks once one was refused (RFC 3030)
+			isBodyFailed = true;
+			isTransient |= code / 100 == 4;
+			body.reset();
+			mailStats.rejections++;
+			MailError(QString("Mail failed: %1 - %2").arg(QString(line)).arg(code));
+		}
+		if (!expected.isEmpty()) return;
+		if (body)
+		{
+			// without PIPELINING the next chunk waits for this reply
+			OnSocketBytesWritten();
+			return;
+		}
+
+		if (isBodyFailed)
+		{
+			EndMail();
+			SendNext();
+		}
+		else FinishMail(code, line);
+		return;
 	}
-	else if (!mailAck)
+
+	// pipelined, the rest of the replies is on the way
+	if (!expected.isEmpty()) return;
+
+	if (isSenderRejected)
 	{
-		mailAck = true;
+		EndMail();
+		SendNext();
 	}
-	else
+	else if (rcptNumber < recipients.count())
 	{
-		rcptAck++;
+		socket->write("rcpt to:<" + ExtractAddress(recipients[rcptNumber], transferFlags & Utf8Headers) + ">\r\n");
+		expected.append(RcptToCommand);
+		rcptNumber++;
 	}
-
-	if (rcptNumber == recipients.count())
+	else if (rcptAck == 0)
 	{
-		// all recipients have been sent
-		if (rcptAck == 0)
-		{
-			emit SignalError(QString("No recipients were considered valid: %1 - %2").arg(QString(line)).arg(code.toInt()));
-			pending.removeFirst();
-			SendNext();
-		}
-		else
-		{
-			// at least one recipient was acknowledged, send mail body
-			socket->write("data\r\n");
-			state = SendingBody;
-		}
+		MailError(QString("No recipients were considered valid: %1 - %2").arg(QString(line)).arg(code));
+		EndMail();
+		SendNext();
 	}
-	else if (state != RcptAckPending)
+	else if (isChunking)
 	{
-		// send the next recipient unless we're only waiting on acks
-		socket->write("rcpt to:<" + ExtractAddress(recipients[rcptNumber]) + ">\r\n");
-		rcptNumber++;
+		// at least one recipient was acknowledged, send mail body in chunks
+		StartBody();
 	}
 	else
 	{
-		// If we're only waiting on acks, just count them
-		rcptNumber++;
+		// at least one recipient was acknowledged, send mail body
+		socket->write("data\r\n");
+		expected.append(DataCommand);
 	}
 }
 
 /**
  * Send body.
  */
-void Smtp::SendBody(const QByteArray& code, const QByteArray& line)
+void Smtp::SendBody(int code, const QByteArray& line)
 {
-	s_p<Mail> mail = pending.first();
+	if (isSenderRejected || rcptAck == 0)
+	{
+		// pipelined DATA of a transaction with nobody to deliver to, reported once here
+		if (!isSenderRejected) MailError(QString("No recipients were considered valid: %1 - %2").arg(QString(line)).arg(code));
+		if (code / 100 == 3)
+		{
+			// it was accepted anyway, end it empty, FinishMail stays silent
+			socket->write(".\r\n");
+			expected.append(BodyCommand);
+			state = BodySent;
+			return;
+		}
+		EndMail();
+		SendNext();
+		return;
+	}
 
-	if (code[0] != '3')
+	if (code / 100 != 3)
 	{
-		emit SignalError(QString("Mail failed: %1 - %2").arg(QString(line)).arg(code.toInt()));
-		pending.removeFirst();
+		isTransient |= code / 100 == 4;
+		mailStats.rejections++;
+		MailError(QString("Mail failed: %1 - %2").arg(QString(line)).arg(code));
+		EndMail();
 		SendNext();
 		return;
 	}
 
-	socket->write(*mail);
-	socket->write(".\r\n");
-	state = BodySent;
+	StartBody();
 }
 
 /**
- * Send ehlo.
+ * Start streaming the body, with DATA or BDAT.
  */
-void Smtp::SendEhlo()
+void Smtp::StartBody()
+{
+	isBodyFailed = false;
+	body.reset(new MailStream(*pending.first(), transferFlags));
+	state = SendingBody;
+	EnterStage(BodyStage);
+	OnSocketBytesWritten();
+}
+
+/**
+ * Final reply to the body.
+ */
+void Smtp::FinishMail(int code, const QByteArray& line)
 {
-	QByteArray address = "127.0.0.1";
-	foreach(const QHostAddress& addr, QNetworkInterface::allAddresses())
+	body.reset();
+	if ( pending.count() )
 	{
-		if (addr == QHostAddress::LocalHost || addr == QHostAddress::LocalHostIPv6)
-			continue;
-		address = addr.toString().toLatin1();
-		break;
+		if (isSenderRejected || rcptAck == 0)
+		{
+			// reported by SendBody
+		}
+		else if (code / 100 != 2)
+		{
+			isTransient |= code / 100 == 4;
+			mailStats.rejections++;
+			MailError(QString("Mail failed 3: %1 - %2").arg(QString(line)).arg(code));
+		}
+		else
+		{
+			isTransient = false; // delivered, to the recipients that were accepted
+			// a coalesced mail is delivered if any of its own recipients was accepted
+			for (int i = 0; i < pending.count(); ++i)
+			{
+				bool isAccepted = false;
+				for (int index : mailRecipients[i]) isAccepted |= recipientAcks[index];
+				if (isAccepted) emit SignalDone(pending[i]);
+				else MailError(pending[i], QString("No recipients were considered valid: %1 - %2").arg(QString(line)).arg(code));
+			}
+		}
+		EndMail();
+		if( pending.count() == 0 && queued == 0 ) emit SignalAllDone();
+	}
+	// the transaction is over either way, no need to reset
+	state = Waiting;
+	SendNext();
+}
+
+/**
+ * Default ehlo domain: the first address that is not a loopback one.
+ * Interfaces are enumerated once per process, shared by all instances.
+ */
+QByteArray Smtp::DefaultEhloDomain()
+{
+	QMutexLocker locker(&ehloMutex);
+	if (ehloDefault.isEmpty())
+	{
+		ehloDefault = "127.0.0.1";
+		foreach(const QHostAddress& addr, QNetworkInterface::allAddresses())
+		{
+			if (addr == QHostAddress::LocalHost || addr == QHostAddress::LocalHostIPv6)
+				continue;
+			ehloDefault = addr.toString().toLatin1();
+			break;
+		}
 	}
-	socket->write("ehlo " + address + "\r\n");
+	return ehloDefault;
+}
+
+/**
+ * Enumerate the interfaces again on the next connection (e.g. the address changed).
+ */
+void Smtp::InvalidateEhloDomain()
+{
+	QMutexLocker locker(&ehloMutex);
+	ehloDefault.clear();
+}
+
+/**
+ * Send ehlo.
+ */
+void Smtp::SendEhlo()
+{
+	QByteArray domain = ehloDomain.isEmpty() ? DefaultEhloDomain() : ehloDomain;
+	socket->write("ehlo " + domain + "\r\n");
 	extensions.clear();
 	state = EhloSent;
 }
@@ -506,44 +707,183 @@ void Smtp::SendEhlo()
 void Smtp::SendNext()
 {
 	if (state == Disconnected) return;
-	if (pending.isEmpty())
+	if (state != Waiting && state != Authenticated)
 	{
-		state = Waiting;
+		// the previous transaction was aborted
+		state = Resetting;
+		socket->write("rset\r\n");
+		{
+			QMutexLocker locker(&statsMutex);
+			stats.resets++;
+		}
+		EnterStage(IdleStage);
 		return;
 	}
-	if (state != Waiting)
+	if (pending.isEmpty()) TakeNext();
+	if (pending.isEmpty())
 	{
-		state = Resetting;
-		socket->write("rset\r\n");
+		state = Waiting;
+		EnterStage(IdleStage);
 		return;
 	}
 	s_p<Mail> mail = pending.first();
-	rcptNumber = rcptAck = mailAck = 0;
-	recipients = mail->GetRecipients(R_TO) +
-				 mail->GetRecipients(R_CC) +
-				 mail->GetRecipients(R_BCC);
+	mailStats = SmtpStats();
+	EnterStage(EnvelopeStage);
+	rcptNumber = rcptReplied = rcptAck = 0;
+	isSenderRejected = false;
+	isTransient = false;
+	recipients.clear();
+	mailRecipients.clear();
+	for (const s_p<Mail>& member : pending)
+	{
+		QStringList own = member->GetRecipients(R_TO) +
+						  member->GetRecipients(R_CC) +
+						  member->GetRecipients(R_BCC);
+		QList<int> indexes;
+		for (const QString& recipient : own)
+		{
+			// coalesced mails share their To and Cc, each address gets one RCPT
+			int index = (pending.count() > 1) ? recipients.indexOf(recipient) : -1;
+			if (index == -1)
+			{
+				index = recipients.count();
+				recipients.append(recipient);
+			}
+			indexes.append(index);
+		}
+		mailRecipients.append(indexes);
+	}
+	recipientAcks = QVector<bool>(recipients.count(), false);
 	if (recipients.count() == 0)
 	{
-		emit SignalError("No recipients!");
-		pending.removeFirst();
+		MailError("No recipients!");
+		EndMail();
 		SendNext();
 		return;
 	}
-	socket->write("mail from:<" + ExtractAddress(mail->GetSender()) + ">\r\n");
+	if (spool && !spool->Load(*mail))
+	{
+		isTransient = true;
+		MailError("Mail failed: its spooled data could not be read");
+		EndMail();
+		SendNext();
+		return;
+	}
+
+	// BDAT needs no dot-stuffing, and allows unencoded attachments
+	isChunking = extensions.contains("CHUNKING");
+	transferFlags = isChunking ? 0 : DotStuffing;
+	if (isChunking && extensions.contains("BINARYMIME") && !mail->GetAttachments().isEmpty())
+	{
+		transferFlags |= BinaryMime;
+	}
+	if (extensions.contains("8BITMIME"))
+	{
+		transferFlags |= EightBit;
+		if (extensions.contains("SMTPUTF8")) transferFlags |= Utf8Headers;
+	}
+	bool isUtf8 = transferFlags & Utf8Headers;
+
+	QByteArray commands = "mail from:<" + ExtractAddress(mail->GetSender(), isUtf8) + ">";
+	if (transferFlags & BinaryMime) commands += " BODY=BINARYMIME";
+	else if (transferFlags & EightBit) commands += " BODY=8BITMIME";
+	if (isUtf8) commands += " SMTPUTF8";
+	commands += "\r\n";
+	expected.append(MailFromCommand);
 	if (extensions.contains("PIPELINING"))
 	{
+		// the whole transaction in one flight (RFC 2920), DATA goes last
 		for (const QString& recipient : recipients)
 		{
-			socket->write("rcpt to:<" + ExtractAddress(recipient) + ">\r\n");
+			commands += "rcpt to:<" + ExtractAddress(recipient, isUtf8) + ">\r\n";
+			expected.append(RcptToCommand);
+		}
+		if (!isChunking)
+		{
+			commands += "data\r\n";
+			expected.append(DataCommand);
 		}
-		state = RcptAckPending;
+		rcptNumber = recipients.count();
 	}
+	socket->write(commands);
+	// pipelined, every RCPT is out and only their replies are awaited
+	state = extensions.contains("PIPELINING") ? RcptAckPending : MailToSent;
+}
+
+/**
+ * Move the next queued mail to be sent: urgent, normal, then the bulk tenant
+ * picked by smooth weighted round robin. Tenants without mail are dropped.
+ */
+void Smtp::TakeNext()
+{
+	MailQueue* queue = nullptr;
+	if (!urgent.mails.isEmpty()) queue = &urgent;
+	else if (!normal.mails.isEmpty()) queue = &normal;
 	else
 	{
-		state = MailToSent;
+		int total = 0;
+		for (auto i = bulk.begin(); i != bulk.end();)
+		{
+			if (i->mails.isEmpty())
+			{
+				i = bulk.erase(i);
+				continue;
+			}
+			int weight = tenantWeights.value(i.key(), 1);
+			i->current += weight;
+			total += weight;
+			if (!queue || i->current > queue->current) queue = &*i;
+			++i;
+		}
+		if (!queue) return;
+		queue->current -= total;
+	}
+	pending.append(queue->mails.takeFirst());
+	queued--;
+	if (coalesceLimit > 0 && !spool) Coalesce(queue->mails);
+}
+
+/**
+ * Move the queued mails with the same content as the one to be sent into its transaction,
+ * up to coalesceLimit recipients. Only the first CoalesceWindow mails of the queue are looked at.
+ * Spooled mails have no content in memory to compare, they are never coalesced.
+ */
+void Smtp::Coalesce(QList<s_p<Mail>>& mails)
+{
+	const Mail& lead = *pending.first();
+	int count = lead.GetRecipients(R_TO).count() + lead.GetRecipients(R_CC).count() + lead.GetRecipients(R_BCC).count();
+	if (count == 0) return;
+
+	int scanned = 0;
+	for (auto i = mails.begin(); i != mails.end() && scanned < CoalesceWindow && count < coalesceLimit; ++scanned)
+	{
+		const Mail& mail = **i;
+		int size = mail.GetRecipients(R_TO).count() + mail.GetRecipients(R_CC).count() + mail.GetRecipients(R_BCC).count();
+		if (size > 0 && count + size <= coalesceLimit && mail.IsSameContent(lead))
+		{
+			pending.append(*i);
+			count += size;
+			i = mails.erase(i);
+			queued--;
+		}
+		else ++i;
 	}
 }
 
+/**
+ * Error of the whole transaction, reported for each of its mails.
+ */
+void Smtp::MailError(const QString& message)
+{
+	for (const s_p<Mail>& mail : pending) MailError(mail, message);
+}
+
+void Smtp::MailError(s_p<Mail> mail, const QString& message)
+{
+	emit SignalMailError(mail, message);
+	emit SignalError(message);
+}
+
 /**
  * Socket error.
  */
@@ -552,117 +892,266 @@ void Smtp::OnSocketError(QAbstractSocket::SocketError err)
 	if( err == QAbstractSocket::RemoteHostClosedError )
 	{
 		state = Disconnected;
+		EnterStage(IdleStage);
 		return;
 	}
 
 	emit SignalError(QString("Socket error [%1]: %2").arg(int(err)).arg(socket->errorString()));
 }
 
+/**
+ * Refill the socket with the body being sent.
+ * Keeps at most a few chunks in the socket buffer.
+ */
+void Smtp::OnSocketBytesWritten(qint64 bytes)
+{
+	{
+		QMutexLocker locker(&statsMutex);
+		stats.bytesWritten += bytes;
+	}
+	mailStats.bytesWritten += bytes;
+	if (!body) return;
+
+	// BDAT commands are only pipelined under PIPELINING (RFC 3030), otherwise one at a time
+	bool isBdatPipelined = extensions.contains("PIPELINING");
+	while (socket->bytesToWrite() < BodyBufferLimit && !body->AtEnd())
+	{
+		if (isChunking && !isBdatPipelined && !expected.isEmpty()) return;
+		QByteArray chunk = body->Read(BodyChunkSize);
+		if (body->IsFailed())
+		{
+			AbortBody();
+			return;
+		}
+		if (isChunking)
+		{
+			QByteArray command = "bdat " + QByteArray::number(chunk.size());
+			if (body->AtEnd()) command += " last";
+			socket->write(command + "\r\n");
+			expected.append(BdatCommand);
+		}
+		socket->write(chunk);
+	}
+	if (body->AtEnd())
+	{
+		if (!isChunking)
+		{
+			socket->write(".\r\n");
+			expected.append(BodyCommand);
+		}
+		body.reset();
+		state = BodySent;
+		EnterStage(FinalReplyStage);
+	}
+}
+
+/**
+ * An attachment could not be read, the body sent so far must not be delivered.
+ * DATA cannot be taken back, so the connection is dropped and the server discards
+ * the transaction, then the queue goes on over a new connection.
+ */
+void Smtp::AbortBody()
+{
+	body.reset();
+	MailError("Mail aborted: an attachment could not be read");
+	EndMail();
+	socket->abort();
+	state = Disconnected;
+	Connect();
+}
+
+/**
+ * TCP is up, TLS goes on for implicit TLS.
+ */
+void Smtp::OnSocketConnected()
+{
+#ifndef QT_NO_OPENSSL
+	EnterStage(TlsStage);
+#else
+	EnterStage(GreetingStage);
+#endif
+}
+
+/**
+ * Handshake done, implicit TLS is followed by the greeting, STARTTLS by the EHLO already sent.
+ */
+void Smtp::OnSocketEncrypted()
+{
+	EnterStage(state == StartState ? GreetingStage : EhloStage);
+}
+
 /**
  * Read.
+ * Replies are parsed in place, the buffer is compacted once per read.
  */
 void Smtp::OnSocketRead()
 {
-	buffer += socket->readAll();
-	while (true)
+	QByteArray data = socket->readAll();
 	{
-		int pos = buffer.indexOf("\r\n");
-		if (pos < 0) return;
-		QByteArray line = buffer.left(pos);
-		buffer = buffer.mid(pos + 2);
-		QByteArray code = line.left(3);
-		switch (state)
+		QMutexLocker locker(&statsMutex);
+		stats.bytesRead += data.size();
+	}
+	mailStats.bytesRead += data.size();
+	buffer += data;
+	SmtpReply reply;
+	int replyPos = 0;
+	int next;
+	while ((next = NextReply(buffer, replyPos, reply)) != -1)
+	{
+		OnReply(reply);
+		replyPos = next;
+	}
+	buffer.remove(0, qMin(replyPos, buffer.size()));
+
+	// first lines of a multi-line EHLO reply, the extensions are still arriving
+	if (state == EhloSent && buffer.contains("\r\n")) state = EhloGreetReceived;
+}
+
+/**
+ * Reply starting at pos, with all the lines of a multi-line one.
+ * Returns the position after it, or -1 until it is complete.
+ */
+int Smtp::NextReply(const QByteArray& buffer, int pos, SmtpReply& reply)
+{
+	reply.lines.clear();
+	while (pos < buffer.size())
+	{
+		int crlfPos = buffer.indexOf("\r\n", pos);
+		if (crlfPos < 0) break;
+
+		const char* line = buffer.constData() + pos;
+		int len = crlfPos - pos;
+		reply.lines.append(QByteArray::fromRawData(line, len));
+		pos = crlfPos + 2;
+		if (len > 3 && line[3] == '-') continue; // multi-line reply goes on
+
+		reply.code = 0;
+		for (int i = 0; i < 3 && i < len && line[i] >= '0' && line[i] <= '9'; ++i)
 		{
-		case StartState:
-			if (code[0] != '2')
-			{
-				state = Disconnected;
-				emit SignalError(QString("Connection failed: ") + line);
-				socket->disconnectFromHost();
-			}
-			else
-			{
-				SendEhlo();
-			}
-			break;
-		case HeloSent:
-		case EhloSent:
-		case EhloGreetReceived:
-			ParseEhlo(code, (line[3] != ' '), line.mid(4));
-			break;
+			reply.code = reply.code * 10 + (line[i] - '0');
+		}
+		return pos;
+	}
+	return -1;
+}
+
+/**
+ * Reply.
+ */
+void Smtp::OnReply(const SmtpReply& reply)
+{
+	int code = reply.code;
+	const QByteArray& line = reply.lines.last();
+	switch (state)
+	{
+	case StartState:
+		if (code / 100 != 2)
+		{
+			state = Disconnected;
+			emit SignalError(QString("Connection failed: ") + line);
+			socket->disconnectFromHost();
+		}
+		else
+		{
+			EnterStage(EhloStage);
+			SendEhlo();
+		}
+		break;
+	case HeloSent:
+	case EhloSent:
+	case EhloGreetReceived:
+		ParseEhlo(reply);
+		break;
 #ifndef QT_NO_OPENSSL
-		case StartTLSSent:
-			if (code == "220")
-			{
-				socket->startClientEncryption();
-				SendEhlo();
-			}
-			else
-			{
-				Authenticate();
-			}
-			break;
+	case StartTLSSent:
+		if (code == 220)
+		{
+			socket->startClientEncryption();
+			SendEhlo();
+		}
+		else
+		{
+			Authenticate();
+		}
+		break;
 #endif
-		case AuthRequestSent:
-		case AuthUsernameSent:
-			if (authType == AuthPlain) AuthenticatePlain();
-			else if (authType == AuthLogin) AuthenticateLogin();
-			else AuthenticateCramMD5(line.mid(4));
-			break;
-		case AuthSent:
-			if (code[0] == '2')
-			{
-				state = Authenticated;
-				SendNext();
-			}
-			else
-			{
-				state = Disconnected;
-				emit SignalError(QString("Authentication failed: ") + line);
-				socket->disconnectFromHost();
-			}
-			break;
-		case MailToSent:
-		case RcptAckPending:
-			if (code[0] != '2') {
-				emit SignalError(QString("Mail failed 2: %1 - %2").arg(QString(line)).arg(code.toInt()));
-				SendNext();
-				state = BodySent;
-			}
-			else SendMail(code, line);
-			break;
-		case SendingBody:
-			SendBody(code, line);
-			break;
-		case BodySent:
-			if ( pending.count() )
-			{
-				if (code[0] != '2')
-				{
-					emit SignalError(QString("Mail failed 3: %1 - %2").arg(QString(line)).arg(code.toInt()));
-				}
-				else
-				{
-					emit SignalDone(pending.first());
-				}
-				pending.removeFirst();
-				if( pending.count() == 0 ) emit SignalAllDone();
-			}
+	case AuthRequestSent:
+	case AuthUsernameSent:
+		if (authType == AuthPlain) AuthenticatePlain();
+		else if (authType == AuthLogin) AuthenticateLogin();
+		else AuthenticateCramMD5(line.mid(4));
+		break;
+	case AuthSent:
+		if (code / 100 == 2)
+		{
+			state = Authenticated;
 			SendNext();
-			break;
-		case Resetting:
-			if (code[0] != '2')
-			{
-				emit SignalError("Connection failed: " + line);
-			}
-			else
-			{
-				state = Waiting;
-				SendNext();
-			}
-			break;
-		default:;
 		}
+		else
+		{
+			state = Disconnected;
+			emit SignalError(QString("Authentication failed: ") + line);
+			socket->disconnectFromHost();
+		}
+		break;
+	case MailToSent:
+	case RcptAckPending:
+	case SendingBody:
+	case BodySent:
+		SendMail(code, line);
+		break;
+	case Resetting:
+		if (code / 100 != 2)
+		{
+			emit SignalError("Connection failed: " + line);
+		}
+		else
+		{
+			state = Waiting;
+			SendNext();
+		}
+		break;
+	default:;
+	}
+}
+
+/**
+ * Account the time since the last transition to the current stage.
+ * Mail stages are accounted to the mail being sent too.
+ */
+void Smtp::EnterStage(SmtpStage next)
+{
+	qint64 now = clock.nsecsElapsed();
+	{
+		QMutexLocker locker(&statsMutex);
+		stats.stageNs[stage] += now - stageStart;
+	}
+	if (stage >= EnvelopeStage) mailStats.stageNs[stage] += now - stageStart;
+	stage = next;
+	stageStart = now;
+}
+
+/**
+ * The mails of the transaction are done, delivered or not.
+ * A spooled mail that failed temporarily is kept for the next MailSpool::Open().
+ */
+void Smtp::EndMail()
+{
+	EnterStage(IdleStage);
+	mailStats.mails = pending.count();
+	{
+		QMutexLocker locker(&statsMutex);
+		stats.rejections += mailStats.rejections;
+		stats.mails += pending.count();
+	}
+	QList<s_p<Mail>> mails = pending;
+	pending.clear();
+	for (const s_p<Mail>& mail : mails)
+	{
+		emit SignalStats(mail, mailStats);
+		if (!spool) continue;
+		if (isTransient) spool->Defer(*mail);
+		else spool->Done(*mail);
 	}
 }
 
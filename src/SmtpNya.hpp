@@ -3,10 +3,14 @@
 
 #include "CommonMail.hpp"
 #include <QAbstractSocket>
+#include <QElapsedTimer>
 #include <QHash>
+#include <QMetaType>
 #include <QList>
+#include <QMutex>
 #include <QPair>
 #include <QStringList>
+#include <QVector>
 
 
 class QTcpSocket;
@@ -21,7 +25,7 @@ enum SmtpState
 	Disconnected,
 	StartState,
 	EhloSent,
-	EhloGreetReceived,
+	EhloGreetReceived, // part of a multi-line EHLO reply, the rest is still arriving
 	EhloExtensionsReceived,
 	EhloDone,
 	HeloSent,
@@ -31,13 +35,22 @@ enum SmtpState
 	AuthSent,
 	Authenticated,
 	MailToSent,
-	RcptAckPending,
+	RcptAckPending, // pipelined envelope sent, waiting for the MAIL and RCPT replies
 	SendingBody,
 	BodySent,
 	Waiting,
 	Resetting
 };
 
+enum SmtpCommand
+{
+	MailFromCommand,
+	RcptToCommand,
+	DataCommand,
+	BodyCommand, // end of DATA
+	BdatCommand
+};
+
 enum SmtpError
 {
 	NoError,
@@ -54,6 +67,59 @@ enum SmtpError
 	TransactionFailed
 };
 
+/**
+ * Server reply with all the lines of a multi-line one.
+ * Lines point into the read buffer and are valid only while the reply is handled.
+ */
+struct SmtpReply
+{
+	int code = 0;
+	QList<QByteArray> lines;
+};
+
+/**
+ * Where the time of a session goes, see SmtpStats.
+ */
+enum SmtpStage
+{
+	IdleStage,       // nothing to send, or resetting a transaction
+	ConnectStage,    // TCP connect
+	TlsStage,        // implicit TLS or STARTTLS handshake
+	GreetingStage,   // waiting for the 220
+	EhloStage,
+	AuthStage,
+	EnvelopeStage,   // MAIL FROM and RCPT TO, until the body can start
+	BodyStage,       // body upload, with DATA or BDAT
+	FinalReplyStage, // the body is out, waiting for the final reply
+	StageCount
+};
+
+/**
+ * Durations in ns from a monotonic clock, and counters of a session or of a transaction.
+ * A transaction only has its own stages, from EnvelopeStage on. Coalesced mails share
+ * one transaction, its stats are reported for each of them with `mails` set to their number.
+ */
+struct SmtpStats
+{
+	qint64 stageNs[StageCount] = {};
+	qint64 bytesWritten = 0;
+	qint64 bytesRead = 0;
+	int mails = 0;
+	int rejections = 0; // negative replies to MAIL, RCPT, DATA and the body
+	int resets = 0;
+	int reconnects = 0;
+};
+
+/**
+ * Queue class of a mail, see Smtp::Send.
+ */
+enum MailPriority
+{
+	UrgentPriority, // always next
+	NormalPriority, // next unless there is urgent mail
+	BulkPriority    // when nothing else waits, shared between the tenants by their weights
+};
+
 enum AuthType
 {
 	AuthPlain,
@@ -63,11 +129,20 @@ enum AuthType
 
 
 class Mail;
+class MailSpool;
+class MailStream;
 class Smtp : public QObject
 {
 	Q_OBJECT
 
+	struct MailQueue
+	{
+		QList<s_p<Mail>> mails;
+		int current = 0; // smooth weighted round robin credit
+	};
+
 	QString host;
+	QByteArray ehloDomain;
 	QByteArray username, password;
 	QByteArray buffer;
 	SmtpState state = Disconnected;
@@ -79,11 +154,33 @@ class Smtp : public QObject
 	QString defaultSubject;
 
 	QStringList recipients;
+	QList<QList<int>> mailRecipients; // indexes into recipients, per pending mail
+	QVector<bool> recipientAcks;
 	QHash<QString, QString> extensions;
-	QList<s_p<Mail>> pending;
+	QList<s_p<Mail>> pending; // the mails being sent, in one transaction when coalesced
+	MailQueue urgent, normal;
+	QHash<QByteArray, MailQueue> bulk;
+	QHash<QByteArray, int> tenantWeights;
+	int queued = 0;
+	int coalesceLimit = 0;
+	s_p<MailSpool> spool;
+	s_p<MailStream> body;
+	QList<SmtpCommand> expected;
 	int rcptNumber;
+	int rcptReplied;
 	int rcptAck;
-	bool mailAck;
+	bool isSenderRejected;
+	bool isChunking;
+	bool isBodyFailed;
+	bool isTransient; // a 4xx reply or a local error, the mail stays in the spool
+	int transferFlags = DotStuffing;
+
+	QElapsedTimer clock;
+	qint64 stageStart = 0;
+	SmtpStage stage = IdleStage;
+	SmtpStats stats; // of the session, guarded by statsMutex for Stats()
+	mutable QMutex statsMutex;
+	SmtpStats mailStats;
 
 #ifndef QT_NO_OPENSSL
 	QSslSocket* socket;
@@ -99,6 +196,9 @@ public:
 	QTcpSocket* GetSocket() const { return (QTcpSocket*)socket; }
 	bool HasExtension(const QString& extension) { return extensions.contains(extension); }
 	QString ExtensionData(const QString& extension) { return extensions[extension]; }
+	SmtpStats Stats() const;
+	int QueuedCount() const { return queued; }
+	int TransferFlags() const { return transferFlags; } // of the current or last transaction, see MailStream
 	bool IsAuthMethodEnabled(AuthType type) const { return allowedAuthTypes & type; }
 
 	void SetPort(quint16 port) { this->port = port; }
@@ -106,13 +206,21 @@ public:
 	void SetSender(const QByteArray& sender) { defaultSender = sender; }
 	void SetRecipients(const QStringList recipients) { defaultRecipients = recipients; }
 	void SetSubject(const QString& subject) { defaultSubject = subject; }
+	void SetEhloDomain(const QByteArray& domain) { ehloDomain = domain; }
+	void SetSpool(s_p<MailSpool> spool);
+	void SetCoalescing(int maxRecipients) { coalesceLimit = maxRecipients; }
+	void SetTenantWeight(const QByteArray& tenant, int weight) { tenantWeights[tenant] = qMax(weight, 1); }
+
+	static QByteArray DefaultEhloDomain();
+	static void InvalidateEhloDomain();
+	static int NextReply(const QByteArray& buffer, int pos, SmtpReply& reply);
 
 	void Connect();
 	void Disconnect();
-	void Send(s_p<Mail> mail);
+	s_p<Mail> Send(s_p<Mail> mail, MailPriority priority = NormalPriority, const QByteArray& tenant = QByteArray());
 
 private:
-	void ParseEhlo(const QByteArray& code, bool cont, const QString& line);
+	void ParseEhlo(const SmtpReply& reply);
 	void StartTLS();
 	void Authenticate();
 
@@ -120,22 +228,41 @@ private:
 	void AuthenticatePlain();
 	void AuthenticateLogin();
 
-	void SendMail(const QByteArray& code, const QByteArray& line);
-	void SendBody(const QByteArray& code, const QByteArray& line);
+	void SendMail(int code, const QByteArray& line);
+	void SendBody(int code, const QByteArray& line);
+	void StartBody();
+	void AbortBody();
+	void FinishMail(int code, const QByteArray& line);
 	void SendEhlo();
 	void SendNext();
+	void TakeNext();
+	void Coalesce(QList<s_p<Mail>>& mails);
+	void MailError(const QString& message);
+	void MailError(s_p<Mail> mail, const QString& message);
+	void OnReply(const SmtpReply& reply);
+	void EnterStage(SmtpStage next);
+	void EndMail();
 
 private slots:
 	void OnSocketError(QAbstractSocket::SocketError err);
 	void OnSocketRead();
+	void OnSocketBytesWritten(qint64 bytes = 0);
+	void OnSocketConnected();
+	void OnSocketEncrypted();
 
 	void OnMail(const QString& text, const QString& subject = "");
 
 signals:
 	void SignalError(const QString& message);
+	void SignalMailError(s_p<Mail> mail, const QString& message); // with SignalError, when a mail fails
 	void SignalDone(s_p<Mail> mail);
 	void SignalAllDone();
+	void SignalStats(s_p<Mail> mail, const SmtpStats& stats); // when a mail is done, delivered or not
 };
 }
 
+// Smtp runs in its own thread without a parent, its signals are queued
+Q_DECLARE_METATYPE(Nya::SmtpStats)
+Q_DECLARE_METATYPE(std::shared_ptr<Nya::Mail>)
+
 #endif // SMTPNYA_H
@@ -0,0 +1,7 @@
+QT = core network
+TEMPLATE = lib
+CONFIG += staticlib
+TARGET = nya_smtp
+
+
+include(../nya_smtp.pri)
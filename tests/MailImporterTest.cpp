@@ -0,0 +1,116 @@
+#include "MailImporterNya.hpp"
+#include "MailNya.hpp"
+
+#include <QDir>
+#include <QSignalSpy>
+#include <QTemporaryDir>
+#include <QtTest>
+
+#include "Tests.hpp"
+
+
+using namespace Nya;
+
+namespace
+{
+bool WriteFile(const QString& path, const QByteArray& data)
+{
+	QFile file(path);
+	return file.open(QIODevice::WriteOnly) && file.write(data) == data.size();
+}
+
+QList<s_p<Mail>> ImportAll(MailImporter& importer, QList<int>& batchSizes)
+{
+	QList<s_p<Mail>> mails;
+	while (!importer.AtEnd())
+	{
+		QList<s_p<Mail>> batch = importer.NextBatch();
+		batchSizes << batch.size();
+		mails += batch;
+	}
+	return mails;
+}
+}
+
+/**
+ * Messages split on "From " lines, quoted ">From " lines lose one '>'.
+ */
+void MailImporterTest::MboxrdQuoting()
+{
+	QTemporaryDir dir;
+	QVERIFY(dir.isValid());
+	QString path = dir.filePath("archive.mbox");
+	QVERIFY(WriteFile(path,
+		"From sender@example.com Mon Jan  1 00:00:00 2024\n"
+		"From: sender@example.com\n"
+		"Subject: First\n"
+		"\n"
+		">From the start\n"
+		">>From twice quoted\n"
+		">Fromage is not quoted\n"
+		"\n"
+		"From sender@example.com Mon Jan  1 00:00:01 2024\n"
+		"From: sender@example.com\n"
+		"Subject: Second\n"
+		"\n"
+		"body\n"));
+
+	MailImporter importer(path, 1);
+	QList<int> batchSizes;
+	QList<s_p<Mail>> mails = ImportAll(importer, batchSizes);
+	QCOMPARE(batchSizes, QList<int>() << 1 << 1);
+	QCOMPARE(mails.size(), 2);
+
+	QVERIFY(mails[0]->IsSameContent(Mail(QByteArray(
+		"From: sender@example.com\r\n"
+		"Subject: First\r\n"
+		"\r\n"
+		"From the start\r\n"
+		">From twice quoted\r\n"
+		">Fromage is not quoted\r\n"))));
+	QVERIFY(mails[1]->IsSameContent(Mail(QByteArray(
+		"From: sender@example.com\r\n"
+		"Subject: Second\r\n"
+		"\r\n"
+		"body\r\n"))));
+}
+
+/**
+ * Files of cur, then new, by name, in batches of the given size.
+ */
+void MailImporterTest::MaildirBatches()
+{
+	QTemporaryDir dir;
+	QVERIFY(dir.isValid());
+	QDir maildir(dir.path());
+	QVERIFY(maildir.mkdir("cur") && maildir.mkdir("new") && maildir.mkdir("tmp"));
+	QVERIFY(WriteFile(maildir.filePath("cur/2"), "Subject: Mail 2\r\n\r\nbody\r\n"));
+	QVERIFY(WriteFile(maildir.filePath("cur/1"), "Subject: Mail 1\r\n\r\nbody\r\n"));
+	QVERIFY(WriteFile(maildir.filePath("new/3"), "Subject: Mail 3\r\n\r\nbody\r\n"));
+	QVERIFY(WriteFile(maildir.filePath("tmp/4"), "Subject: Mail 4\r\n\r\nbody\r\n"));
+
+	MailImporter importer(dir.path(), 2);
+	QList<int> batchSizes;
+	QList<s_p<Mail>> mails = ImportAll(importer, batchSizes);
+	QCOMPARE(batchSizes, QList<int>() << 2 << 1);
+
+	QStringList subjects;
+	for (const s_p<Mail>& mail : mails) subjects << mail->GetSubject();
+	QCOMPARE(subjects, QStringList() << "Mail 1" << "Mail 2" << "Mail 3");
+}
+
+/**
+ * An mbox that cannot be opened is an error, not an empty archive.
+ */
+void MailImporterTest::MissingMbox()
+{
+	QTemporaryDir dir;
+	QVERIFY(dir.isValid());
+	MailImporter importer(dir.filePath("missing.mbox"));
+	QSignalSpy errors(&importer, &MailImporter::SignalError);
+
+	QVERIFY(!importer.AtEnd());
+	QVERIFY(importer.NextBatch().isEmpty());
+	QCOMPARE(errors.size(), 1);
+	QVERIFY(importer.AtEnd());
+}
@@ -0,0 +1,104 @@
+#include "MailNya.hpp"
+#include "MailSpoolNya.hpp"
+
+#include <QTemporaryDir>
+#include <QtTest>
+
+#include "Tests.hpp"
+
+
+using namespace Nya;
+
+namespace
+{
+s_p<Mail> NewMail(int number)
+{
+	s_p<Mail> mail(new Mail("sender@example.com", QString("Spooled %1").arg(number), QString(1000, 'x')));
+	mail->AddRecipient(QString("rcpt%1@example.com").arg(number));
+	mail->AddRecipient(QString("bcc%1@example.com").arg(number), R_BCC);
+	return mail;
+}
+}
+
+void MailSpoolTest::TornRecord_data()
+{
+	QTest::addColumn<bool>("isTruncated"); // or a byte of the last record changed
+
+	QTest::newRow("truncated") << true;
+	QTest::newRow("corrupted") << false;
+}
+
+/**
+ * A crash in the middle of the last record loses that record only.
+ */
+void MailSpoolTest::TornRecord()
+{
+	QFETCH(bool, isTruncated);
+	QTemporaryDir dir;
+	QVERIFY(dir.isValid());
+	QList<s_p<Mail>> mails;
+	{
+		MailSpool spool(dir.path());
+		QVERIFY(spool.Open());
+		for (int i = 0; i < 3; ++i)
+		{
+			mails << NewMail(i);
+			QVERIFY(spool.Append(*mails.last()));
+		}
+		spool.Commit();
+	}
+
+	QFile segment(dir.filePath("00000001.seg"));
+	QVERIFY(segment.open(QIODevice::ReadWrite));
+	qint64 size = segment.size();
+	if (isTruncated)
+	{
+		QVERIFY(segment.resize(size - 10));
+	}
+	else
+	{
+		QVERIFY(segment.seek(size - 10));
+		QVERIFY(segment.write("y", 1) == 1);
+	}
+	segment.close();
+
+	MailSpool spool(dir.path());
+	QVERIFY(spool.Open());
+	QList<s_p<Mail>> recovered = spool.TakeRecovered();
+	QCOMPARE(recovered.size(), 2);
+	QCOMPARE(spool.Count(), 2);
+	for (int i = 0; i < recovered.size(); ++i)
+	{
+		QCOMPARE(recovered[i]->GetSender(), mails[i]->GetSender());
+		// the envelope keeps the addresses, not their types
+		QCOMPARE(recovered[i]->GetRecipients(R_TO), mails[i]->GetRecipients(R_TO) + mails[i]->GetRecipients(R_BCC));
+		spool.Load(*recovered[i]);
+		QCOMPARE(WireData(*recovered[i], 0), WireData(*mails[i], 0));
+	}
+	QVERIFY(QFileInfo(segment).size() < size);
+}
+
+/**
+ * Mails done before the commit are not sent again.
+ */
+void MailSpoolTest::DoneNotRecovered()
+{
+	QTemporaryDir dir;
+	QVERIFY(dir.isValid());
+	s_p<Mail> kept = NewMail(1);
+	{
+		MailSpool spool(dir.path());
+		QVERIFY(spool.Open());
+		s_p<Mail> sent = spool.Append(*NewMail(0));
+		QVERIFY(sent);
+		QVERIFY(spool.Append(*kept));
+		spool.Done(*sent);
+		spool.Commit();
+	}
+
+	MailSpool spool(dir.path());
+	QVERIFY(spool.Open());
+	QList<s_p<Mail>> recovered = spool.TakeRecovered();
+	QCOMPARE(recovered.size(), 1);
+	QCOMPARE(recovered[0]->GetRecipients(R_TO), kept->GetRecipients(R_TO) + kept->GetRecipients(R_BCC));
+}
@@ -0,0 +1,59 @@
+#include "AttachmentNya.hpp"
+#include "MailNya.hpp"
+#include "MailTemplateNya.hpp"
+
+#include <QtTest>
+
+#include "Tests.hpp"
+
+
+using namespace Nya;
+
+namespace
+{
+const QByteArray Binary("\x00\x01\r\n.\r\n\xff\xfe line\r\n", 16);
+}
+
+void MailTemplateTest::PlainSerialization_data()
+{
+	QTest::addColumn<QString>("text");
+	QTest::addColumn<int>("templateFlags");
+	QTest::addColumn<int>("flags"); // of the session
+
+	QString slotText = "Hello {{name}},\n.starts with a dot\nGrüße\n";
+	QTest::newRow("7bit") << slotText << 0 << 0;
+	QTest::newRow("7bit over DATA") << slotText << 0 << int(DotStuffing);
+	QTest::newRow("dot-stuffed") << slotText << int(DotStuffing) << int(DotStuffing);
+	QTest::newRow("8BITMIME") << slotText << int(EightBit) << int(EightBit);
+	QTest::newRow("8BITMIME over DATA") << slotText << int(EightBit | DotStuffing) << int(EightBit | DotStuffing);
+	QTest::newRow("fixed text") << QString("Fixed text\n.starts with a dot\n") << 0 << int(DotStuffing);
+}
+
+/**
+ * A rendered mail is sent byte for byte as the same mail built by hand.
+ * Text with placeholders is not sent as 7bit, so the slot rows use non-ASCII text.
+ */
+void MailTemplateTest::PlainSerialization()
+{
+	QFETCH(QString, text);
+	QFETCH(int, templateFlags);
+	QFETCH(int, flags);
+
+	Mail source("sender@example.com", "Hello {{name}}", text);
+	source.AddExtraHeader("X-Campaign", "{{campaign}}");
+	source.AddAttachment("binary.bin", new Attachment(&Binary));
+	MailTemplate mailTemplate(source, templateFlags);
+
+	QHash<QString, QString> values;
+	values.insert("name", "Jörg");
+	values.insert("campaign", "spring");
+	s_p<Mail> rendered = mailTemplate.CreateMail(QStringList() << "rcpt@example.com", values);
+	QCOMPARE(rendered->GetSubject(), QString("Hello Jörg"));
+	QCOMPARE(rendered->ExtraHeaders().value("X-Campaign"), QByteArray("spring"));
+
+	// same fields and boundary, serialized without the rendered data
+	Mail plain(*rendered);
+	plain.SetText(MailTemplate::Substitute(text, values));
+	QCOMPARE(WireData(*rendered, flags), WireData(plain, flags));
+	QCOMPARE(QByteArray(*rendered), QByteArray(plain));
+}
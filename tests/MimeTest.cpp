@@ -0,0 +1,118 @@
+#include "AttachmentNya.hpp"
+#include "MailNya.hpp"
+#include "MailParserNya.hpp"
+#include "Rfc2822.hpp"
+
+#include <QtTest>
+
+#include "Tests.hpp"
+
+
+using namespace Nya;
+
+namespace
+{
+// mixed: alternative (plain, html), attachment
+const QByteArray Nested =
+	"From: sender@example.com\r\n"
+	"To: rcpt@example.com\r\n"
+	"Subject: Nested\r\n"
+	"MIME-Version: 1.0\r\n"
+	"Content-Type: multipart/mixed; boundary=\"outer\"\r\n"
+	"\r\n"
+	"preamble\r\n"
+	"--outer\r\n"
+	"Content-Type: multipart/alternative; boundary=\"inner\"\r\n"
+	"\r\n"
+	"--inner\r\n"
+	"Content-Type: text/plain; charset=utf-8\r\n"
+	"\r\n"
+	"plain\r\n"
+	"body\r\n"
+	"--inner\r\n"
+	"Content-Type: text/html; charset=utf-8\r\n"
+	"\r\n"
+	"<p>html body</p>\r\n"
+	"--inner--\r\n"
+	"\r\n"
+	"--outer\r\n"
+	"Content-Type: application/octet-stream; name=\"a.bin\"\r\n"
+	"Content-Disposition: attachment; filename=\"a.bin\"\r\n"
+	"Content-Transfer-Encoding: base64\r\n"
+	"\r\n"
+	"aGVsbG8g\r\n"
+	"d29ybGQ=\r\n"
+	"--outer--\r\n"
+	"epilogue\r\n";
+}
+
+/**
+ * Parts of a multipart inside a multipart, in document order with their parents.
+ */
+void MimeTest::NestedMultipart()
+{
+	QList<MimePart> parts = Rfc2822::ParseMime(Nested);
+	QCOMPARE(parts.size(), 5);
+
+	QList<int> parents;
+	for (const MimePart& part : parts) parents << part.parent;
+	QCOMPARE(parents, QList<int>() << -1 << 0 << 1 << 1 << 0);
+
+	auto body = [&](int i) { return Nested.mid(parts[i].bodyPos, parts[i].bodyEnd - parts[i].bodyPos); };
+	QCOMPARE(body(2), QByteArray("plain\r\nbody"));
+	QCOMPARE(body(3), QByteArray("<p>html body</p>"));
+	QCOMPARE(body(4), QByteArray("aGVsbG8g\r\nd29ybGQ="));
+	QCOMPARE(Rfc2822::DecodeBody(body(4), "base64", false), QByteArray("hello world"));
+	QCOMPARE(parts[1].headers.value("content-type"), QByteArray("multipart/alternative; boundary=\"inner\""));
+	QVERIFY(Nested.mid(parts[4].begin).startsWith("--outer\r\n"));
+	QCOMPARE(parts[4].end, Nested.indexOf("--outer--"));
+
+	Mail mail(Nested);
+	QCOMPARE(mail.GetSubject(), QString("Nested"));
+	QCOMPARE(mail.GetAttachments().keys(), QStringList() << "a.bin");
+}
+
+void MimeTest::FeedChunks_data()
+{
+	QTest::addColumn<QList<int>>("cuts"); // chunk boundaries
+
+	QList<int> bytes;
+	for (int i = 1; i < Nested.size(); ++i) bytes << i;
+	QTest::newRow("whole") << QList<int>();
+	QTest::newRow("delimiter") << (QList<int>() << Nested.indexOf("--inner--") + 4);
+	QTest::newRow("break before delimiter") << (QList<int>() << Nested.indexOf("\r\n--outer--") + 1);
+	QTest::newRow("base64 quad") << (QList<int>() << Nested.indexOf("d29y") + 2);
+	QTest::newRow("bytewise") << bytes;
+}
+
+/**
+ * The same parts and data however the message is cut into chunks.
+ */
+void MimeTest::FeedChunks()
+{
+	QFETCH(QList<int>, cuts);
+	MailParser parser;
+	QList<int> parents, ended;
+	QHash<int, QByteArray> data;
+	connect(&parser, &MailParser::SignalPartStart, [&](int part, int parent) {
+		QCOMPARE(part, parents.size());
+		parents << parent;
+	});
+	connect(&parser, &MailParser::SignalPartData, [&](int part, const QByteArray& chunk) { data[part] += chunk; });
+	connect(&parser, &MailParser::SignalPartEnd, [&](int part) { ended << part; });
+
+	int pos = 0;
+	for (int cut : cuts + (QList<int>() << Nested.size()))
+	{
+		parser.Feed(Nested.mid(pos, cut - pos));
+		pos = cut;
+	}
+	parser.Finish();
+
+	QCOMPARE(parents, QList<int>() << -1 << 0 << 1 << 1 << 0);
+	QCOMPARE(ended, QList<int>() << 2 << 3 << 1 << 4 << 0);
+	QCOMPARE(data.keys().size(), 3);
+	QCOMPARE(data.value(2), QByteArray("plain\nbody"));
+	QCOMPARE(data.value(3), QByteArray("<p>html body</p>"));
+	QCOMPARE(data.value(4), QByteArray("hello world"));
+}
@@ -0,0 +1,240 @@
+#include "AttachmentNya.hpp"
+#include "FakeSmtpServerNya.hpp"
+#include "MailNya.hpp"
+#include "MailSpoolNya.hpp"
+#include "SmtpNya.hpp"
+
+#include <QSignalSpy>
+#include <QTemporaryDir>
+#include <QtTest>
+#ifndef QT_NO_OPENSSL
+#include <QSslSocket>
+#endif
+
+#include "Tests.hpp"
+
+
+using namespace Nya;
+
+namespace
+{
+const QByteArray Binary("\x00\x01\r\n.\r\n\xff\xfe line\r\n", 16);
+
+/**
+ * Mail with a line to dot-stuff, non-ASCII text and a binary attachment.
+ */
+s_p<Mail> NewMail(int number, const QString& recipient)
+{
+	QString text = QString("Mail %1\n.starts with a dot\nGrüße\n").arg(number);
+	s_p<Mail> mail(new Mail("sender@example.com", QString("Test %1").arg(number), text));
+	if (!recipient.isEmpty()) mail->AddRecipient(recipient);
+	mail->AddAttachment("binary.bin", new Attachment(&Binary));
+	return mail;
+}
+}
+
+void SmtpTest::init()
+{
+	server = new FakeSmtpServer(this);
+#ifndef QT_NO_OPENSSL
+	// the client always uses implicit TLS
+	QFile certFile(QFINDTESTDATA("data/localhost.crt")), keyFile(QFINDTESTDATA("data/localhost.key"));
+	QVERIFY(certFile.open(QIODevice::ReadOnly));
+	QVERIFY(keyFile.open(QIODevice::ReadOnly));
+	server->SetTls(QSslCertificate(&certFile), QSslKey(&keyFile, QSsl::Rsa));
+#endif
+	QVERIFY(server->listen(QHostAddress::LocalHost, 0));
+}
+
+void SmtpTest::cleanup()
+{
+	delete server;
+	server = nullptr;
+}
+
+/**
+ * Client in this thread, deleted with the server.
+ */
+Smtp* SmtpTest::Client()
+{
+	Smtp* smtp = new Smtp("127.0.0.1", QByteArray(), QByteArray(), server);
+	smtp->SetPort(server->serverPort());
+#ifndef QT_NO_OPENSSL
+	QSslSocket* socket = qobject_cast<QSslSocket*>(smtp->GetSocket());
+	connect(socket, static_cast<void (QSslSocket::*)(const QList<QSslError>&)>(&QSslSocket::sslErrors),
+			[socket] { socket->ignoreSslErrors(); });
+#endif
+	return smtp;
+}
+
+void SmtpTest::Extensions_data()
+{
+	QTest::addColumn<QStringList>("extensions");
+	QTest::addColumn<int>("flags"); // the message is received as MailStream makes it for these
+
+	QTest::newRow("none") << QStringList() << 0;
+	QTest::newRow("PIPELINING") << (QStringList() << "PIPELINING") << 0;
+	QTest::newRow("CHUNKING") << (QStringList() << "CHUNKING") << 0;
+	QTest::newRow("CHUNKING PIPELINING") << (QStringList() << "CHUNKING" << "PIPELINING") << 0;
+	QTest::newRow("8BITMIME") << (QStringList() << "8BITMIME") << int(EightBit);
+	QTest::newRow("PIPELINING 8BITMIME") << (QStringList() << "PIPELINING" << "8BITMIME") << int(EightBit);
+	QTest::newRow("CHUNKING BINARYMIME") << (QStringList() << "CHUNKING" << "BINARYMIME") << int(BinaryMime);
+	QTest::newRow("all") << (QStringList() << "PIPELINING" << "8BITMIME" << "CHUNKING" << "BINARYMIME")
+						 << int(BinaryMime | EightBit);
+}
+
+/**
+ * Every mail arrives whole, in its own transaction, whatever the server advertises.
+ */
+void SmtpTest::Extensions()
+{
+	QFETCH(QStringList, extensions);
+	QFETCH(int, flags);
+	server->SetExtensions(extensions);
+	Smtp* smtp = Client();
+	QSignalSpy done(smtp, &Smtp::SignalDone);
+	QSignalSpy errors(smtp, &Smtp::SignalError);
+
+	QList<s_p<Mail>> mails;
+	for (int i = 0; i < 3; ++i)
+	{
+		mails << NewMail(i, QString("rcpt%1@example.com").arg(i));
+		smtp->Send(mails.last());
+	}
+	smtp->Connect();
+	QTRY_COMPARE_WITH_TIMEOUT(done.count(), mails.size(), 10000);
+	QCOMPARE(errors.count(), 0);
+
+	QList<FakeSmtpTransaction> transactions = server->Transactions();
+	QCOMPARE(transactions.size(), mails.size());
+	for (int i = 0; i < mails.size(); ++i)
+	{
+		QCOMPARE(done[i][0].value<s_p<Mail>>(), mails[i]);
+		QCOMPARE(transactions[i].mailFrom, QByteArray("sender@example.com"));
+		QCOMPARE(transactions[i].rcptTo, QList<QByteArray>() << QString("rcpt%1@example.com").arg(i).toLatin1());
+		QCOMPARE(transactions[i].data, WireData(*mails[i], flags));
+	}
+}
+
+/**
+ * A refused sender is reported once per mail, not once more per pipelined reply after it.
+ */
+void SmtpTest::SenderRejected()
+{
+	server->SetExtensions(QStringList() << "PIPELINING");
+	server->SetReply("MAIL", 550, "5.7.1 Sender rejected");
+	Smtp* smtp = Client();
+	QSignalSpy stats(smtp, &Smtp::SignalStats);
+	QSignalSpy errors(smtp, &Smtp::SignalMailError);
+	QSignalSpy done(smtp, &Smtp::SignalDone);
+
+	s_p<Mail> first = NewMail(0, "rcpt0@example.com");
+	first->AddRecipient("rcpt1@example.com");
+	s_p<Mail> second = NewMail(1, "rcpt2@example.com");
+	smtp->Send(first);
+	smtp->Send(second);
+	smtp->Connect();
+	QTRY_COMPARE_WITH_TIMEOUT(stats.count(), 2, 10000);
+
+	QCOMPARE(errors.count(), 2);
+	QCOMPARE(errors[0][0].value<s_p<Mail>>(), first);
+	QCOMPARE(errors[1][0].value<s_p<Mail>>(), second);
+	QCOMPARE(done.count(), 0);
+	QCOMPARE(server->Transactions().size(), 0);
+}
+
+/**
+ * Coalesced mails share the transaction, yet each is reported on its own recipients.
+ */
+void SmtpTest::CoalescedRecipientRejected()
+{
+	server->SetExtensions(QStringList() << "PIPELINING");
+	server->SetRecipientReply("unknown@example.com", 550, "5.1.1 No such user");
+	Smtp* smtp = Client();
+	smtp->SetCoalescing(10);
+	QSignalSpy errors(smtp, &Smtp::SignalMailError);
+	QSignalSpy done(smtp, &Smtp::SignalDone);
+
+	s_p<Mail> known = NewMail(0, QString());
+	known->AddRecipient("known@example.com", R_BCC);
+	s_p<Mail> unknown(new Mail(*known));
+	unknown->RemoveRecipient("known@example.com");
+	unknown->AddRecipient("unknown@example.com", R_BCC);
+	smtp->Send(known);
+	smtp->Send(unknown);
+	smtp->Connect();
+	QTRY_COMPARE_WITH_TIMEOUT(done.count() + errors.count(), 2, 10000);
+
+	QCOMPARE(done.count(), 1);
+	QCOMPARE(done[0][0].value<s_p<Mail>>(), known);
+	QCOMPARE(errors.count(), 1);
+	QCOMPARE(errors[0][0].value<s_p<Mail>>(), unknown);
+	QCOMPARE(server->Transactions().size(), 1);
+	QCOMPARE(server->Transactions().first().rcptTo, QList<QByteArray>() << "known@example.com");
+}
+
+/**
+ * Spooled mails are reported as the pointers Send() returned, and only a temporary
+ * failure stays in the spool.
+ */
+void SmtpTest::SpooledRejections()
+{
+	QTemporaryDir dir;
+	QVERIFY(dir.isValid());
+	s_p<MailSpool> spool(new MailSpool(dir.path()));
+	QVERIFY(spool->Open());
+	server->SetRecipientReply("later@example.com", 451, "4.3.0 Try again later");
+	server->SetRecipientReply("never@example.com", 550, "5.1.1 No such user");
+	Smtp* smtp = Client();
+	smtp->SetSpool(spool);
+	QSignalSpy stats(smtp, &Smtp::SignalStats);
+	QSignalSpy done(smtp, &Smtp::SignalDone);
+
+	s_p<Mail> delivered = smtp->Send(NewMail(0, "now@example.com"));
+	QVERIFY(delivered);
+	smtp->Send(NewMail(1, "later@example.com"));
+	smtp->Send(NewMail(2, "never@example.com"));
+	smtp->Connect();
+	QTRY_COMPARE_WITH_TIMEOUT(stats.count(), 3, 10000);
+	QCOMPARE(done.count(), 1);
+	QCOMPARE(done[0][0].value<s_p<Mail>>(), delivered);
+
+	delete server; // and the client with it
+	server = nullptr;
+	spool.reset();
+	MailSpool reopened(dir.path());
+	QVERIFY(reopened.Open());
+	QList<s_p<Mail>> recovered = reopened.TakeRecovered();
+	QCOMPARE(recovered.size(), 1);
+	QCOMPARE(recovered[0]->GetRecipients(), QStringList() << "later@example.com");
+}
+
+/**
+ * Urgent mail goes first, then normal mail, and the bulk tenants share the rest by weight.
+ */
+void SmtpTest::TenantWeights()
+{
+	Smtp* smtp = Client();
+	smtp->SetTenantWeight("heavy", 2);
+	smtp->SetTenantWeight("light", 1);
+	QSignalSpy done(smtp, &Smtp::SignalDone);
+
+	for (int i = 0; i < 4; ++i)
+	{
+		smtp->Send(NewMail(i, QString("heavy%1@example.com").arg(i)), BulkPriority, "heavy");
+		smtp->Send(NewMail(i, QString("light%1@example.com").arg(i)), BulkPriority, "light");
+	}
+	smtp->Send(NewMail(0, "normal@example.com"));
+	smtp->Send(NewMail(0, "urgent@example.com"), UrgentPriority);
+	smtp->Connect();
+	QTRY_COMPARE_WITH_TIMEOUT(done.count(), 10, 10000);
+
+	QList<QByteArray> order;
+	for (const FakeSmtpTransaction& transaction : server->Transactions()) order += transaction.rcptTo;
+	// smooth weighted round robin: 2 of every 3 bulk mails are heavy while both tenants wait
+	QCOMPARE(order, QList<QByteArray>()
+					<< "urgent@example.com" << "normal@example.com"
+					<< "heavy0@example.com" << "light0@example.com" << "heavy1@example.com"
+					<< "heavy2@example.com" << "light1@example.com" << "heavy3@example.com"
+					<< "light2@example.com" << "light3@example.com");
+}
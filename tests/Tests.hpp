@@ -0,0 +1,94 @@
+#ifndef TESTS_HPP
+#define TESTS_HPP
+
+#include "CommonMail.hpp"
+#include <QObject>
+
+
+namespace Nya
+{
+class FakeSmtpServer;
+class Mail;
+class Smtp;
+}
+
+/**
+ * Whole message as MailStream produces it for the flags.
+ */
+QByteArray WireData(const Nya::Mail& mail, int flags);
+
+/**
+ * Smtp against FakeSmtpServer, for the extensions a server may advertise and its refusals.
+ */
+class SmtpTest : public QObject
+{
+	Q_OBJECT
+
+	Nya::FakeSmtpServer* server = nullptr;
+
+	Nya::Smtp* Client();
+
+private slots:
+	void init();
+	void cleanup();
+
+	void Extensions_data();
+	void Extensions();
+	void SenderRejected();
+	void CoalescedRecipientRejected();
+	void SpooledRejections();
+	void TenantWeights();
+};
+
+/**
+ * MailSpool recovery after a crash.
+ */
+class MailSpoolTest : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void TornRecord_data();
+	void TornRecord();
+	void DoneNotRecovered();
+};
+
+/**
+ * MailImporter splitting of mbox files and listing of Maildirs.
+ */
+class MailImporterTest : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void MboxrdQuoting();
+	void MaildirBatches();
+	void MissingMbox();
+};
+
+/**
+ * MailTemplate output against the plain serialization.
+ */
+class MailTemplateTest : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void PlainSerialization_data();
+	void PlainSerialization();
+};
+
+/**
+ * MIME tree of a parsed message, and the push parser fed in chunks.
+ */
+class MimeTest : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void NestedMultipart();
+	void FeedChunks_data();
+	void FeedChunks();
+};
+
+#endif // TESTS_HPP
@@ -0,0 +1,32 @@
+#include "MailStreamNya.hpp"
+
+#include <QCoreApplication>
+#include <QtTest>
+
+#include "Tests.hpp"
+
+
+QByteArray WireData(const Nya::Mail& mail, int flags)
+{
+	QByteArray data;
+	Nya::MailStream stream(mail, flags);
+	while (!stream.AtEnd()) data += stream.Read();
+	return data;
+}
+
+int main(int argc, char* argv[])
+{
+	QCoreApplication app(argc, argv);
+	int result = 0;
+	SmtpTest smtpTest;
+	result |= QTest::qExec(&smtpTest, argc, argv);
+	MailSpoolTest spoolTest;
+	result |= QTest::qExec(&spoolTest, argc, argv);
+	MailImporterTest importerTest;
+	result |= QTest::qExec(&importerTest, argc, argv);
+	MailTemplateTest templateTest;
+	result |= QTest::qExec(&templateTest, argc, argv);
+	MimeTest mimeTest;
+	result |= QTest::qExec(&mimeTest, argc, argv);
+	return result;
+}
@@ -0,0 +1,19 @@
+QT = core network testlib
+TEMPLATE = app
+CONFIG += console testcase
+CONFIG -= app_bundle
+TARGET = nya_tests
+
+include(../nya_smtp_lib.pri)
+include(../tools/tools.pri)
+
+SOURCES += \
+	main.cpp \
+	MailImporterTest.cpp \
+	MailSpoolTest.cpp \
+	MailTemplateTest.cpp \
+	MimeTest.cpp \
+	SmtpTest.cpp
+
+HEADERS += \
+	Tests.hpp
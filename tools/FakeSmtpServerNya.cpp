@@ -0,0 +1,430 @@
+#include "Base64.hpp"
+
+#include <QElapsedTimer>
+#include <QTimer>
+#ifndef QT_NO_OPENSSL
+#include <QSslSocket>
+#else
+#include <QTcpSocket>
+#endif
+
+#include "FakeSmtpServerNya.hpp"
+
+
+namespace Nya
+{
+/**
+ * One client connection of FakeSmtpServer.
+ * Replies are queued by the time they are due, so latency never reorders them.
+ */
+class FakeSmtpSession : public QObject
+{
+	enum Mode
+	{
+		CommandMode,
+		DataMode,
+		BdatMode,
+		AuthMode
+	};
+
+	enum Action
+	{
+		NoAction,
+		DropAction,
+		TlsAction,
+		QuitAction
+	};
+
+	struct Pending
+	{
+		qint64 due;
+		QByteArray data;
+		Action action;
+	};
+
+	FakeSmtpServer* server;
+	QTcpSocket* socket;
+	QByteArray buffer;
+	Mode mode = CommandMode;
+	int authSteps = 0; // continuation lines still expected
+	qint64 bdatLeft = 0;
+	bool isBdatLast = false;
+	bool isInTransaction = false;
+	bool isDropping = false;
+	FakeSmtpTransaction transaction;
+	QElapsedTimer clock;
+	QList<Pending> queue;
+	qint64 lastDue = 0;
+	QTimer timer;
+
+public:
+	FakeSmtpSession(FakeSmtpServer* server, QTcpSocket* socket);
+
+private:
+	void OnRead();
+	void OnLine(const QByteArray& line);
+	void OnCommand(const QByteArray& line);
+	void OnAuth(const QByteArray& arg);
+	void EndData(bool isChunk);
+	void Reply(const QByteArray& command, const QByteArray& reply, Action action = NoAction);
+	void Flush();
+	QByteArray ReplyFor(const QByteArray& command, const QByteArray& standard) const { return server->replies.value(command, standard); }
+};
+
+/**
+ * Address between the angle brackets of a MAIL or RCPT argument.
+ */
+static QByteArray Address(const QByteArray& arg)
+{
+	int begin = arg.indexOf('<');
+	int end = arg.indexOf('>', begin + 1);
+	if (begin == -1 || end == -1) return arg.mid(arg.indexOf(':') + 1).trimmed();
+	return arg.mid(begin + 1, end - begin - 1);
+}
+
+FakeSmtpSession::FakeSmtpSession(FakeSmtpServer* server, QTcpSocket* socket)
+	: QObject(server)
+	, server(server)
+	, socket(socket)
+{
+	socket->setParent(this);
+	clock.start();
+	timer.setSingleShot(true);
+	connect(&timer, &QTimer::timeout, this, [this] { Flush(); });
+	connect(socket, &QTcpSocket::readyRead, this, [this] { OnRead(); });
+	connect(socket, &QTcpSocket::disconnected, this, &QObject::deleteLater);
+	Reply("CONNECT", ReplyFor("CONNECT", "220 " + server->domain + " ESMTP fake"));
+}
+
+/**
+ * Handle every complete line or BDAT chunk, pipelined commands in order.
+ */
+void FakeSmtpSession::OnRead()
+{
+	buffer += socket->readAll();
+	bool isCommand = false;
+	int pos = 0;
+	while (pos < buffer.size() && !isDropping)
+	{
+		if (mode == BdatMode)
+		{
+			int len = int(qMin<qint64>(bdatLeft, buffer.size() - pos));
+			transaction.data.append(buffer.constData() + pos, len);
+			pos += len;
+			bdatLeft -= len;
+			if (bdatLeft > 0) break;
+			mode = CommandMode;
+			EndData(true);
+			continue;
+		}
+
+		int crlfPos = buffer.indexOf("\r\n", pos);
+		if (crlfPos < 0) break;
+		if (mode == CommandMode) isCommand = true;
+		OnLine(buffer.mid(pos, crlfPos - pos));
+		pos = crlfPos + 2;
+	}
+	buffer.remove(0, pos);
+	if (isCommand) ++server->readCount;
+}
+
+void FakeSmtpSession::OnLine(const QByteArray& line)
+{
+	switch (mode)
+	{
+	case DataMode:
+		if (line == ".")
+		{
+			mode = CommandMode;
+			EndData(false);
+		}
+		else
+		{
+			transaction.data += line.startsWith('.') ? line.mid(1) : line;
+			transaction.data += "\r\n";
+		}
+		break;
+	case AuthMode:
+		if (--authSteps > 0)
+		{
+			Reply("AUTH", "334 UGFzc3dvcmQ6"); // Password:
+			break;
+		}
+		mode = CommandMode;
+		Reply("AUTH", ReplyFor("AUTH", "235 2.7.0 Authentication successful"));
+		break;
+	default:
+		OnCommand(line);
+	}
+}
+
+void FakeSmtpSession::OnCommand(const QByteArray& line)
+{
+	++server->commandCount;
+	int space = line.indexOf(' ');
+	QByteArray verb = line.left(space).toUpper();
+	QByteArray arg = (space == -1) ? QByteArray() : line.mid(space + 1);
+
+	if (verb == "EHLO")
+	{
+		isInTransaction = false;
+		QByteArray reply = ReplyFor(verb, QByteArray());
+		if (reply.isEmpty())
+		{
+			QList<QByteArray> lines;
+			lines << server->domain;
+			for (const QString& extension : server->extensions) lines << extension.toLatin1();
+			for (int i = 0; i < lines.size(); ++i)
+			{
+				reply += ((i + 1 < lines.size()) ? "250-" : "250 ") + lines[i];
+				if (i + 1 < lines.size()) reply += "\r\n";
+			}
+		}
+		Reply(verb, reply);
+	}
+	else if (verb == "HELO")
+	{
+		isInTransaction = false;
+		Reply(verb, ReplyFor(verb, "250 " + server->domain));
+	}
+	else if (verb == "STARTTLS")
+	{
+#ifndef QT_NO_OPENSSL
+		if (!server->certificate.isNull() && !((QSslSocket*)socket)->isEncrypted())
+		{
+			Reply(verb, ReplyFor(verb, "220 2.0.0 Ready to start TLS"), TlsAction);
+			return;
+		}
+#endif
+		Reply(verb, "454 4.7.0 TLS not available");
+	}
+	else if (verb == "AUTH")
+	{
+		OnAuth(arg);
+	}
+	else if (verb == "MAIL")
+	{
+		transaction = FakeSmtpTransaction();
+		transaction.mailFrom = Address(arg);
+		QByteArray reply = ReplyFor(verb, "250 2.1.0 Ok");
+		isInTransaction = reply.startsWith('2');
+		Reply(verb, reply);
+	}
+	else if (verb == "RCPT")
+	{
+		if (!isInTransaction)
+		{
+			Reply(verb, "503 5.5.1 Need MAIL command");
+			return;
+		}
+		QByteArray address = Address(arg);
+		QByteArray reply = server->recipientReplies.value(address.toLower(), ReplyFor(verb, "250 2.1.5 Ok"));
+		if (reply.startsWith('2')) transaction.rcptTo.append(address);
+		Reply(verb, reply);
+	}
+	else if (verb == "DATA")
+	{
+		if (!isInTransaction || transaction.rcptTo.isEmpty())
+		{
+			Reply(verb, "554 5.5.1 No valid recipients");
+			return;
+		}
+		QByteArray reply = ReplyFor(verb, "354 End data with <CR><LF>.<CR><LF>");
+		if (reply.startsWith("354")) mode = DataMode;
+		Reply(verb, reply);
+	}
+	else if (verb == "BDAT")
+	{
+		QList<QByteArray> args = arg.split(' ');
+		bdatLeft = args[0].toLongLong();
+		isBdatLast = args.size() > 1 && args[1].toUpper() == "LAST";
+		mode = BdatMode;
+		if (bdatLeft == 0)
+		{
+			mode = CommandMode;
+			EndData(true);
+		}
+	}
+	else if (verb == "RSET")
+	{
+		isInTransaction = false;
+		Reply(verb, ReplyFor(verb, "250 2.0.0 Ok"));
+	}
+	else if (verb == "NOOP")
+	{
+		Reply(verb, ReplyFor(verb, "250 2.0.0 Ok"));
+	}
+	else if (verb == "QUIT")
+	{
+		Reply(verb, ReplyFor(verb, "221 2.0.0 Bye"), QuitAction);
+	}
+	else
+	{
+		Reply(verb, "502 5.5.2 Command not recognized");
+	}
+}
+
+/**
+ * AUTH PLAIN, LOGIN or CRAM-MD5, with or without an initial response.
+ */
+void FakeSmtpSession::OnAuth(const QByteArray& arg)
+{
+	QList<QByteArray> args = arg.split(' ');
+	QByteArray mechanism = args[0].toUpper();
+	bool isInitial = args.size() > 1;
+	if (mechanism == "PLAIN")
+	{
+		authSteps = isInitial ? 0 : 1;
+		if (!isInitial) Reply("AUTH", "334 ");
+	}
+	else if (mechanism == "LOGIN")
+	{
+		authSteps = isInitial ? 1 : 2;
+		Reply("AUTH", isInitial ? "334 UGFzc3dvcmQ6" : "334 VXNlcm5hbWU6"); // Password:, Username:
+	}
+	else if (mechanism == "CRAM-MD5")
+	{
+		authSteps = 1;
+		Reply("AUTH", "334 " + ToBase64("<1896.697170952@" + server->domain + ">"));
+	}
+	else
+	{
+		Reply("AUTH", "504 5.5.4 Unrecognized authentication type");
+		return;
+	}
+
+	if (authSteps > 0) mode = AuthMode;
+	else Reply("AUTH", ReplyFor("AUTH", "235 2.7.0 Authentication successful"));
+}
+
+/**
+ * End of DATA or of a BDAT chunk, the end of the message records the transaction.
+ */
+void FakeSmtpSession::EndData(bool isChunk)
+{
+	if (isChunk && !isInTransaction)
+	{
+		Reply("BDAT", "503 5.5.1 Need MAIL command");
+		return;
+	}
+	if (isChunk && transaction.rcptTo.isEmpty())
+	{
+		Reply("BDAT", "554 5.5.1 No valid recipients");
+		return;
+	}
+	if (isChunk && !isBdatLast)
+	{
+		Reply("BDAT", ReplyFor("BDAT", "250 2.0.0 Chunk received"));
+		return;
+	}
+
+	QByteArray reply = ReplyFor(".", "250 2.0.0 Ok: queued");
+	transaction.code = reply.left(3).toInt();
+	isInTransaction = false;
+	server->transactions.append(transaction);
+	emit server->SignalTransaction(transaction);
+	Reply(".", reply);
+}
+
+/**
+ * Queue a reply after the ones before it, with the latency of the command.
+ */
+void FakeSmtpSession::Reply(const QByteArray& command, const QByteArray& reply, Action action)
+{
+	if (server->drops.contains(command))
+	{
+		isDropping = true;
+		queue.append(Pending{qMax(clock.elapsed(), lastDue), QByteArray(), DropAction});
+		Flush();
+		return;
+	}
+	qint64 due = qMax(clock.elapsed() + server->latencies.value(command), lastDue);
+	lastDue = due;
+	queue.append(Pending{due, reply + "\r\n", action});
+	Flush();
+}
+
+/**
+ * Write the replies that are due, the timer is set for the next one.
+ */
+void FakeSmtpSession::Flush()
+{
+	qint64 now = clock.elapsed();
+	while (!queue.isEmpty() && queue.first().due <= now)
+	{
+		Pending pending = queue.takeFirst();
+		if (pending.action == DropAction)
+		{
+			socket->abort();
+			return;
+		}
+		socket->write(pending.data);
+#ifndef QT_NO_OPENSSL
+		if (pending.action == TlsAction) ((QSslSocket*)socket)->startServerEncryption();
+#endif
+		if (pending.action == QuitAction) socket->disconnectFromHost();
+	}
+	if (!queue.isEmpty()) timer.start(int(queue.first().due - now));
+}
+
+//==============================================================================
+FakeSmtpServer::FakeSmtpServer(QObject* parent)
+	: QTcpServer(parent)
+{}
+
+/**
+ * Reply for a command, text defaults to a generic one.
+ */
+void FakeSmtpServer::SetReply(const QByteArray& command, int code, const QByteArray& text)
+{
+	replies[command.toUpper()] = QByteArray::number(code) + ' ' + (text.isEmpty() ? QByteArray("Fake reply") : text);
+}
+
+/**
+ * Reply to RCPT for one address, instead of the RCPT one.
+ */
+void FakeSmtpServer::SetRecipientReply(const QByteArray& address, int code, const QByteArray& text)
+{
+	recipientReplies[address.toLower()] = QByteArray::number(code) + ' ' + (text.isEmpty() ? QByteArray("Fake reply") : text);
+}
+
+/**
+ * Drop the connection instead of replying to the command.
+ */
+void FakeSmtpServer::SetDrop(const QByteArray& command, bool isOn)
+{
+	if (isOn) drops.insert(command.toUpper());
+	else drops.remove(command.toUpper());
+}
+
+#ifndef QT_NO_OPENSSL
+/**
+ * TLS from the start (SMTPS), or on STARTTLS if not implicit.
+ */
+void FakeSmtpServer::SetTls(const QSslCertificate& certificate, const QSslKey& key, bool isImplicit)
+{
+	this->certificate = certificate;
+	this->key = key;
+	isImplicitTls = isImplicit;
+}
+#endif
+
+void FakeSmtpServer::incomingConnection(qintptr handle)
+{
+#ifndef QT_NO_OPENSSL
+	QSslSocket* socket = new QSslSocket;
+	socket->setSocketDescriptor(handle);
+	if (!certificate.isNull())
+	{
+		socket->setLocalCertificate(certificate);
+		socket->setPrivateKey(key);
+		if (isImplicitTls) socket->startServerEncryption();
+	}
+#else
+	QTcpSocket* socket = new QTcpSocket;
+	socket->setSocketDescriptor(handle);
+#endif
+	++connectionCount;
+	new FakeSmtpSession(this, socket);
+}
+}
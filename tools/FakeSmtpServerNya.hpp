@@ -0,0 +1,85 @@
+#ifndef FAKESMTPSERVERNYA_H
+#define FAKESMTPSERVERNYA_H
+
+#include "CommonMail.hpp"
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QStringList>
+#include <QTcpServer>
+#ifndef QT_NO_OPENSSL
+#include <QSslCertificate>
+#include <QSslKey>
+#endif
+
+
+namespace Nya
+{
+/**
+ * Transaction received by FakeSmtpServer.
+ */
+struct FakeSmtpTransaction
+{
+	QByteArray mailFrom;
+	QList<QByteArray> rcptTo; // accepted ones
+	QByteArray data; // dot-unstuffed, or the BDAT chunks joined
+	int code = 0; // reply to the end of data
+};
+
+/**
+ * Scriptable SMTP server for load and latency tests without a real one.
+ * Commands are keyed by their verb: CONNECT (the greeting), EHLO, HELO, STARTTLS, AUTH
+ * (its final reply), MAIL, RCPT, DATA, "." (end of data), BDAT, RSET, NOOP and QUIT.
+ * Any credentials are accepted unless the AUTH reply says otherwise.
+ */
+class FakeSmtpServer : public QTcpServer
+{
+	Q_OBJECT
+
+	friend class FakeSmtpSession;
+
+	QByteArray domain = "fake.example.com";
+	QStringList extensions;
+	QHash<QByteArray, QByteArray> replies;
+	QHash<QByteArray, QByteArray> recipientReplies;
+	QHash<QByteArray, int> latencies;
+	QSet<QByteArray> drops;
+	QList<FakeSmtpTransaction> transactions;
+	int connectionCount = 0;
+	int commandCount = 0;
+	int readCount = 0;
+#ifndef QT_NO_OPENSSL
+	QSslCertificate certificate;
+	QSslKey key;
+	bool isImplicitTls = false;
+#endif
+
+public:
+	FakeSmtpServer(QObject* parent = 0);
+
+	void SetDomain(const QByteArray& domain) { this->domain = domain; }
+	void SetExtensions(const QStringList& extensions) { this->extensions = extensions; }
+	void SetReply(const QByteArray& command, int code, const QByteArray& text = QByteArray());
+	void SetRecipientReply(const QByteArray& address, int code, const QByteArray& text = QByteArray());
+	void SetLatency(const QByteArray& command, int ms) { latencies[command.toUpper()] = ms; }
+	void SetDrop(const QByteArray& command, bool isOn = true);
+#ifndef QT_NO_OPENSSL
+	void SetTls(const QSslCertificate& certificate, const QSslKey& key, bool isImplicit = true);
+#endif
+
+	QList<FakeSmtpTransaction> Transactions() const { return transactions; }
+	void ClearTransactions() { transactions.clear(); }
+	int ConnectionCount() const { return connectionCount; }
+	int CommandCount() const { return commandCount; }
+	int ReadCount() const { return readCount; } // reads carrying commands, about the round trips
+
+protected:
+	void incomingConnection(qintptr handle);
+
+signals:
+	void SignalTransaction(const FakeSmtpTransaction& transaction);
+};
+}
+
+#endif // FAKESMTPSERVERNYA_H
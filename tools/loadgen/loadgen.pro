@@ -0,0 +1,11 @@
+QT = core network
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+TARGET = nya_loadgen
+
+include(../../nya_smtp_lib.pri)
+include(../tools.pri)
+
+SOURCES += \
+	main.cpp
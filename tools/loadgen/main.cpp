@@ -0,0 +1,356 @@
+#include "AttachmentNya.hpp"
+#include "FakeSmtpServerNya.hpp"
+#include "MailNya.hpp"
+#include "MailStreamNya.hpp"
+#include "SmtpNya.hpp"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QSemaphore>
+#include <QStringList>
+#include <QTextStream>
+#include <QThread>
+#include <QTimer>
+#ifndef QT_NO_OPENSSL
+#include <QSslSocket>
+#endif
+#include <algorithm>
+#include <vector>
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+
+using namespace Nya;
+
+namespace
+{
+struct Options
+{
+	QString host = "localhost";
+	quint16 port = 0;
+	QByteArray user, password;
+	int messages = 1000;
+	int bodySize = 4096;
+	int attachments = 0;
+	int attachmentSize = 64 * 1024;
+	int recipients = 1;
+	int connections = 1;
+	int window = 1;
+	int stallTimeout = 30;
+	bool isFake = false;
+	bool isInsecure = false;
+	QStringList extensions = QStringList() << "PIPELINING" << "8BITMIME" << "CHUNKING";
+	QString cert, key;
+};
+
+/**
+ * FakeSmtpServer on its own thread, so it does not share the client's event loop and CPU time.
+ */
+class FakeServerThread : public QThread
+{
+	const Options& options;
+	QSemaphore ready;
+	quint16 port = 0;
+	QString error;
+
+public:
+	FakeServerThread(const Options& options) : options(options) {}
+
+	/**
+	 * Starts the thread and waits for the server to listen, 0 on failure.
+	 */
+	quint16 Listen(QString& error)
+	{
+		start();
+		ready.acquire();
+		error = this->error;
+		return port;
+	}
+
+protected:
+	void run()
+	{
+		FakeSmtpServer server;
+		server.SetExtensions(options.extensions);
+		// transactions are not needed, and would grow with every message
+		QObject::connect(&server, &FakeSmtpServer::SignalTransaction, [&server] { server.ClearTransactions(); });
+#ifndef QT_NO_OPENSSL
+		QFile certFile(options.cert), keyFile(options.key);
+		if (!certFile.open(QIODevice::ReadOnly) || !keyFile.open(QIODevice::ReadOnly))
+		{
+			error = "--fake needs --cert and --key, the client always uses implicit TLS";
+			ready.release();
+			return;
+		}
+		server.SetTls(QSslCertificate(&certFile), QSslKey(&keyFile, QSsl::Rsa));
+#endif
+		if (!server.listen(QHostAddress::LocalHost, 0)) error = server.errorString();
+		port = server.serverPort();
+		ready.release();
+		if (error.isEmpty()) exec();
+	}
+};
+
+/**
+ * One client connection, keeping `window` messages queued in its Smtp.
+ * Each mail ends with SignalDone or SignalMailError.
+ */
+struct Connection
+{
+	Smtp* smtp;
+	QList<QPair<s_p<Mail>, qint64>> inFlight; // with the time of Send()
+
+	/**
+	 * Time the mail was sent at, -1 if it is not in flight.
+	 */
+	qint64 Take(const s_p<Mail>& mail)
+	{
+		for (int i = 0; i < inFlight.size(); ++i)
+		{
+			if (inFlight[i].first == mail) return inFlight.takeAt(i).second;
+		}
+		return -1;
+	}
+};
+
+/**
+ * Size of the message as Smtp sends it with the transfer flags.
+ */
+qint64 WireSize(const Mail& mail, int flags)
+{
+	qint64 size = 0;
+	MailStream stream(mail, flags);
+	while (!stream.AtEnd()) size += stream.Read().size();
+	return size;
+}
+
+QByteArray Blob(int size)
+{
+	QByteArray blob(size, Qt::Uninitialized);
+	quint32 seed = 2463534242u;
+	for (int i = 0; i < size; ++i)
+	{
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		blob[i] = char(seed);
+	}
+	return blob;
+}
+
+double CpuSeconds()
+{
+#ifdef Q_OS_UNIX
+	struct rusage usage;
+#ifdef RUSAGE_THREAD
+	getrusage(RUSAGE_THREAD, &usage); // the client only, not the fake server thread
+#else
+	getrusage(RUSAGE_SELF, &usage);
+#endif
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#else
+	return 0;
+#endif
+}
+
+void Usage(QTextStream& err)
+{
+	err << "usage: nya_loadgen [--host H] [--port P] [--user U --password P] [--messages N]\n"
+		   "                   [--body-size BYTES] [--attachments N] [--attachment-size BYTES]\n"
+		   "                   [--recipients N] [--connections N] [--window N] [--insecure]\n"
+		   "                   [--fake [--extensions A,B,...] [--cert PEM --key PEM]] [--stall-timeout S]\n";
+}
+
+bool ParseArguments(const QStringList& args, Options& options)
+{
+	for (int i = 1; i < args.size(); ++i)
+	{
+		QString arg = args[i];
+		if (arg == "--fake") { options.isFake = true; continue; }
+		if (arg == "--insecure") { options.isInsecure = true; continue; }
+		if (i + 1 == args.size()) return false;
+		QString value = args[++i];
+		bool isOk = true;
+		if (arg == "--host") options.host = value;
+		else if (arg == "--port") options.port = value.toUShort(&isOk);
+		else if (arg == "--user") options.user = value.toUtf8();
+		else if (arg == "--password") options.password = value.toUtf8();
+		else if (arg == "--messages") options.messages = value.toInt(&isOk);
+		else if (arg == "--body-size") options.bodySize = value.toInt(&isOk);
+		else if (arg == "--attachments") options.attachments = value.toInt(&isOk);
+		else if (arg == "--attachment-size") options.attachmentSize = value.toInt(&isOk);
+		else if (arg == "--recipients") options.recipients = value.toInt(&isOk);
+		else if (arg == "--connections") options.connections = value.toInt(&isOk);
+		else if (arg == "--window") options.window = value.toInt(&isOk);
+		else if (arg == "--stall-timeout") options.stallTimeout = value.toInt(&isOk);
+		else if (arg == "--extensions") options.extensions = value.split(',', QString::SkipEmptyParts);
+		else if (arg == "--cert") options.cert = value;
+		else if (arg == "--key") options.key = value;
+		else return false;
+		if (!isOk) return false;
+	}
+	return options.messages > 0 && options.connections > 0 && options.window > 0 && options.recipients > 0 &&
+		   options.bodySize >= 0 && options.attachments >= 0 && options.attachmentSize >= 0;
+}
+}
+
+/**
+ * Sends N generated messages over several connections and reports throughput,
+ * latency percentiles from Send() to SignalDone, and client CPU time per message.
+ * The report is one JSON object, like nya_bench.
+ */
+int main(int argc, char* argv[])
+{
+	QCoreApplication app(argc, argv);
+	QTextStream out(stdout), err(stderr);
+	Options options;
+	if (!ParseArguments(app.arguments(), options))
+	{
+		Usage(err);
+		return 2;
+	}
+
+	FakeServerThread fake(options);
+	if (options.isFake)
+	{
+		QString error;
+		options.host = "127.0.0.1";
+		options.port = fake.Listen(error);
+		if (!error.isEmpty())
+		{
+			err << "fake server: " << error << "\n";
+			return 1;
+		}
+		options.isInsecure = true;
+	}
+
+	QString text(options.bodySize, 'x');
+	for (int i = 72; i < text.size(); i += 73) text[i] = '\n';
+	QByteArray attachment = Blob(options.attachmentSize);
+	int created = 0;
+	auto createMail = [&] {
+		s_p<Mail> mail(new Mail("loadgen@example.com", QString("Load %1").arg(++created), text));
+		for (int i = 0; i < options.recipients; ++i) mail->AddRecipient(QString("rcpt%1@example.com").arg(i));
+		for (int i = 0; i < options.attachments; ++i)
+			mail->AddAttachment(QString("file%1.bin").arg(i), new Attachment(&attachment));
+		return mail;
+	};
+	qint64 messageBytes = 0; // as sent, once the first mail is delivered
+
+	QElapsedTimer clock;
+	std::vector<qint64> latencies;
+	latencies.reserve(options.messages);
+	int sent = 0, failed = 0;
+	QList<Connection*> connections;
+	QTimer stall;
+	stall.setSingleShot(true);
+	stall.setInterval(options.stallTimeout * 1000);
+	QObject::connect(&stall, &QTimer::timeout, [&] {
+		err << "no progress for " << options.stallTimeout << " s, giving up\n";
+		app.exit(1);
+	});
+
+	auto refill = [&](Connection* c) {
+		while (c->inFlight.size() < options.window && sent < options.messages)
+		{
+			qint64 start = clock.nsecsElapsed();
+			++sent;
+			c->inFlight.append(qMakePair(c->smtp->Send(createMail()), start));
+		}
+		if (int(latencies.size()) + failed == options.messages) app.quit();
+	};
+
+	for (int i = 0; i < options.connections; ++i)
+	{
+		Connection* c = new Connection;
+		c->smtp = new Smtp(options.host, options.user, options.password, &app);
+		if (options.port) c->smtp->SetPort(options.port);
+#ifndef QT_NO_OPENSSL
+		if (options.isInsecure)
+		{
+			QSslSocket* socket = qobject_cast<QSslSocket*>(c->smtp->GetSocket());
+			QObject::connect(socket, static_cast<void (QSslSocket::*)(const QList<QSslError>&)>(&QSslSocket::sslErrors),
+							 [socket] { socket->ignoreSslErrors(); });
+		}
+#endif
+		QObject::connect(c->smtp, &Smtp::SignalDone, [&, c](s_p<Mail> mail) {
+			qint64 start = c->Take(mail);
+			if (start < 0) return;
+			latencies.push_back(clock.nsecsElapsed() - start);
+			if (!messageBytes) messageBytes = WireSize(*mail, c->smtp->TransferFlags());
+			stall.start();
+			refill(c);
+		});
+		QObject::connect(c->smtp, &Smtp::SignalMailError, [&, c](s_p<Mail> mail) {
+			if (c->Take(mail) < 0) return;
+			++failed;
+			stall.start();
+			refill(c);
+		});
+		QObject::connect(c->smtp, &Smtp::SignalError, [&](const QString& message) {
+			if (failed < 10) err << message << "\n";
+		});
+		connections.append(c);
+	}
+
+	double cpuStart = CpuSeconds();
+	clock.start();
+	for (Connection* c : connections)
+	{
+		c->smtp->Connect();
+		refill(c);
+	}
+	stall.start();
+	int result = app.exec();
+	double seconds = clock.nsecsElapsed() / 1e9;
+	double cpu = CpuSeconds() - cpuStart;
+
+	SmtpStats stats;
+	for (Connection* c : connections)
+	{
+		SmtpStats connectionStats = c->smtp->Stats();
+		for (int i = 0; i < StageCount; ++i) stats.stageNs[i] += connectionStats.stageNs[i];
+		stats.rejections += connectionStats.rejections;
+		stats.resets += connectionStats.resets;
+		c->smtp->Disconnect();
+		delete c;
+	}
+	if (options.isFake)
+	{
+		fake.quit();
+		fake.wait();
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&](double p) {
+		if (latencies.empty()) return 0.0;
+		size_t i = std::min(latencies.size() - 1, size_t(p * latencies.size()));
+		return latencies[i] / 1e6;
+	};
+	int done = int(latencies.size());
+	out << "{\"tool\":\"loadgen\",\"messages\":" << done
+		<< ",\"failed\":" << failed
+		<< ",\"unfinished\":" << options.messages - done - failed // left by a stall
+		<< ",\"connections\":" << options.connections
+		<< ",\"message_bytes\":" << messageBytes
+		<< ",\"seconds\":" << seconds
+		<< ",\"msgs_per_s\":" << done / seconds
+		<< ",\"mb_per_s\":" << done * messageBytes / seconds / 1e6
+		<< ",\"p50_ms\":" << percentile(0.5)
+		<< ",\"p99_ms\":" << percentile(0.99)
+		<< ",\"p999_ms\":" << percentile(0.999)
+		<< ",\"cpu_us_per_msg\":" << (done ? cpu / done * 1e6 : 0)
+		<< ",\"rejections\":" << stats.rejections
+		<< ",\"resets\":" << stats.resets
+		<< ",\"stage_ms\":{";
+	const char* stageNames[StageCount] = {"idle", "connect", "tls", "greeting", "ehlo", "auth", "envelope", "body", "final_reply"};
+	for (int i = 0; i < StageCount; ++i)
+	{
+		out << (i ? "," : "") << '"' << stageNames[i] << "\":" << stats.stageNs[i] / 1e6;
+	}
+	out << "}}\n";
+	return result;
+}
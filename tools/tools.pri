@@ -0,0 +1,7 @@
+INCLUDEPATH += $$PWD
+
+HEADERS += \
+	$$PWD/FakeSmtpServerNya.hpp
+
+SOURCES += \
+	$$PWD/FakeSmtpServerNya.cpp